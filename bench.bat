@@ -0,0 +1,5 @@
+@rem Needs UMKA_DIR pointing to a directory with umka.lib and umka.dll
+call build.bat
+cl /O2 bench\bench.c /Febench\bench.exe "%UMKA_DIR%\umka.lib"
+set PATH=%UMKA_DIR%;%PATH%
+bench\bench.exe %*
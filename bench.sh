@@ -0,0 +1,6 @@
+# Needs UMKA_DIR pointing to a directory with libumka.so. Pass a case name
+# filter or "-o file.json" through to the benchmark.
+set -e
+sh build.sh
+gcc -O2 bench/bench.c -o bench/bench -L"$UMKA_DIR" -Wl,-rpath,"$UMKA_DIR" -lumka -lm -pthread
+./bench/bench "$@"
@@ -0,0 +1,230 @@
+// Times the reflection API from a host embedding Umka. Every case is an
+// exported function of bench/cases.um that repeats one operation n times.
+// The batch size is grown until a batch takes long enough to time, then a
+// fixed number of batches is sampled.
+//
+// Usage: bench [filter] [-o results.json]
+// Only cases whose name contains filter are run. Results are printed as a
+// table and written as JSON, one object per case.
+//
+// Every entry point of refl.um has a case, except for these, which run the
+// same code as a case that is timed:
+//   Map.value, Array.underlying, Dynarray.underlying: keyMap,
+//     underlyingPointer
+//   TypeGraph count, kind, location, size, alignment, underlying, key,
+//     returnType, length, isMethod, hasUpvalues: graphNameWide, each reads
+//     one field of a type record
+//   TypeGraph.variants: graphFieldsWide
+//   typeptr, handle: nothing to time, they return a stored pointer
+// The type graph and JSON file cases write bench/graph.bin and
+// bench/list.json.
+
+#include "../umka_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+enum { NUM_SAMPLES = 31, MAX_BATCH = 1 << 20 };
+
+static const double MIN_BATCH_NS = 2e6;
+
+static const char *cases[] = {
+    "mkWide",           "nameWide",         "locationWide",
+    "sizeDeep",         "fieldsWide",       "fieldOffsetWide",
+    "fieldIndexWide",   "fieldAtWide",      "layoutDeep",
+    "variantsLong",     "variantNameLong",  "parseLong",
+    "ifaceMethodsBig",  "paramsDeep",       "returnTypeDeep",
+    "isMethodDeep",     "hasUpvaluesDeep",  "underlyingPointer",
+    "isWeakPointer",    "lengthArray",      "keyMap",
+    "formatDeep",       "moduleTypes",      "methodsBig",
+    "findMethodBig",    "implementsBig",    "typeHashDeep",
+    "sameTypeDeep",     "canConvert",       "conversionMatrix",
+    "exportTypeGraph",  "loadTypeGraph",    "graphFindWide",
+    "graphNameWide",    "graphFieldsWide",  "getFieldWide",
+    "setFieldWide",     "encodeList",       "decodeList",
+    "toJSONList",       "writeJSONList",    "equalList",
+    "hashList",         "cloneList",        "migrateWide",
+    "toSoAParticles",   "fromSoAParticles", "scanParticles",
+    "encodeParticles",  "encodeParallelParticles",
+    "stats",            "resetStats"};
+
+typedef struct {
+  const char *name;
+  int64_t batch;
+  double nsPerOp, p50, p90, p99, min;
+  double heapBytesPerOp;
+} Result;
+
+static double nowNs(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart * 1e9 / frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int len, double p) {
+  int i = (int)(p * (len - 1) + 0.5);
+  return sorted[i];
+}
+
+static bool runBatch(void *umka, UmkaFuncContext *fn, int64_t n,
+                     double *elapsed) {
+  umkaGetParam(fn->params, 0)->intVal = n;
+
+  double start = nowNs();
+  int status = umkaCall(umka, fn);
+  *elapsed = nowNs() - start;
+
+  return status == 0 && umkaAlive(umka);
+}
+
+static bool runCase(void *umka, const char *name, Result *result) {
+  UmkaFuncContext fn;
+  if (!umkaGetFunc(umka, NULL, name, &fn)) {
+    fprintf(stderr, "%s: no such function\n", name);
+    return false;
+  }
+
+  result->name = name;
+
+  // Warms the caches up and finds a batch size worth timing
+  double elapsed;
+  int64_t batch = 1;
+  for (;;) {
+    if (!runBatch(umka, &fn, batch, &elapsed))
+      return false;
+    if (elapsed >= MIN_BATCH_NS || batch >= MAX_BATCH)
+      break;
+    batch *= 2;
+  }
+  result->batch = batch;
+
+  double samples[NUM_SAMPLES];
+  double total = 0;
+  int64_t heapBefore = umkaGetMemUsage(umka);
+
+  for (int i = 0; i < NUM_SAMPLES; i++) {
+    if (!runBatch(umka, &fn, batch, &elapsed))
+      return false;
+    samples[i] = elapsed / batch;
+    total += elapsed;
+  }
+
+  int64_t heapAfter = umkaGetMemUsage(umka);
+  qsort(samples, NUM_SAMPLES, sizeof(double), compareDoubles);
+
+  result->nsPerOp = total / ((double)batch * NUM_SAMPLES);
+  result->min = samples[0];
+  result->p50 = percentile(samples, NUM_SAMPLES, 0.5);
+  result->p90 = percentile(samples, NUM_SAMPLES, 0.9);
+  result->p99 = percentile(samples, NUM_SAMPLES, 0.99);
+  result->heapBytesPerOp =
+      (double)(heapAfter - heapBefore) / ((double)batch * NUM_SAMPLES);
+  return true;
+}
+
+static void writeJson(FILE *file, const Result *results, int len) {
+  fprintf(file, "[\n");
+  for (int i = 0; i < len; i++) {
+    const Result *r = &results[i];
+    fprintf(file,
+            "  {\"name\": \"%s\", \"batch\": %lld, \"ns_per_op\": %.2f, "
+            "\"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, "
+            "\"heap_bytes_per_op\": %.2f}%s\n",
+            r->name, (long long)r->batch, r->nsPerOp, r->min, r->p50, r->p90,
+            r->p99, r->heapBytesPerOp, i + 1 < len ? "," : "");
+  }
+  fprintf(file, "]\n");
+}
+
+static void printError(void *umka) {
+  UmkaError *error = umkaGetError(umka);
+  fprintf(stderr, "%s (%d, %d): %s\n", error->fileName, error->line, error->pos,
+          error->msg);
+}
+
+int main(int argc, char **argv) {
+  const char *filter = NULL;
+  const char *output = "bench/results.json";
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      output = argv[++i];
+    else
+      filter = argv[i];
+  }
+
+  void *umka = umkaAlloc();
+  if (!umkaInit(umka, "bench/cases.um", NULL, 1024 * 1024, NULL, 0, NULL,
+                true, true, NULL) ||
+      !umkaCompile(umka)) {
+    printError(umka);
+    umkaFree(umka);
+    return 1;
+  }
+
+  // Runs main(), which sets up the values the cases work on
+  if (umkaRun(umka) != 0) {
+    printError(umka);
+    umkaFree(umka);
+    return 1;
+  }
+
+  int numCases = sizeof(cases) / sizeof(cases[0]);
+  Result *results = calloc(numCases, sizeof(Result));
+  int numResults = 0;
+  int status = 0;
+
+  printf("%-24s %10s %12s %12s %12s %12s %14s\n", "case", "batch", "ns/op",
+         "p50", "p90", "p99", "heap B/op");
+
+  for (int i = 0; i < numCases; i++) {
+    if (filter && strstr(cases[i], filter) == NULL)
+      continue;
+
+    Result *r = &results[numResults];
+    if (!runCase(umka, cases[i], r)) {
+      if (!umkaAlive(umka))
+        printError(umka);
+      status = 1;
+      break;
+    }
+
+    printf("%-24s %10lld %12.1f %12.1f %12.1f %12.1f %14.1f\n", r->name,
+           (long long)r->batch, r->nsPerOp, r->p50, r->p90, r->p99,
+           r->heapBytesPerOp);
+    numResults++;
+  }
+
+  FILE *file = fopen(output, "w");
+  if (file) {
+    writeJson(file, results, numResults);
+    fclose(file);
+  } else {
+    fprintf(stderr, "can't write %s\n", output);
+    status = 1;
+  }
+
+  free(results);
+  umkaFree(umka);
+  return status;
+}
@@ -0,0 +1,67 @@
+# Writes bench/types.um, a module of a few hundred nested types for
+# bench/format.um and tests/format.um. Pass the number of struct types, 300 by
+# default. The types form chains of 16 embedded by value, and each one also
+# refers to earlier types through dynarrays, maps, pointers, closures and
+# interfaces, so formatting All nests deeply and expands every type.
+set -e
+n=${1:-300}
+out=bench/types.um
+
+{
+    echo "// Generated by bench/gentypes.sh $n, do not edit"
+    echo
+    echo "type ("
+
+    i=0
+    while [ $i -lt $n ]; do
+        if [ $((i % 10)) -eq 0 ]; then
+            echo "    E$i* = enum {"
+            echo "        a"
+            echo "        b = $((i + 1))"
+            echo "        c"
+            echo "    }"
+            echo
+        fi
+
+        echo "    T$i* = struct {"
+        echo "        kind: E$((i / 10 * 10))"
+        if [ $i -eq 0 ]; then
+            echo "        name: str"
+        else
+            if [ $((i % 16)) -ne 0 ]; then
+                echo "        up: T$((i - 1))"
+            fi
+            echo "        items: []T$(((i * 37 + 11) % i))"
+            echo "        index: map[str]^T$(((i * 53 + 5) % i))"
+            if [ $((i % 3)) -eq 0 ]; then
+                echo "        grid: [3]^T$((i / 2))"
+            fi
+            if [ $((i % 5)) -eq 0 ]; then
+                echo "        back: weak ^T$((i - 1))"
+            fi
+            if [ $((i % 7)) -eq 0 ]; then
+                echo "        cb: fn (x: T$((i - 1)), n: int): ^T$((i / 3))"
+            fi
+            if [ $((i % 11)) -eq 0 ]; then
+                echo "        src: interface {"
+                echo "            get(): ^T$((i - 1))"
+                echo "            set(v: T$((i / 2)))"
+                echo "        }"
+            fi
+        fi
+        echo "    }"
+        echo
+
+        i=$((i + 1))
+    done
+
+    # Newest first, so that the first field expands most of the set
+    echo "    All* = struct {"
+    i=$((n - 1))
+    while [ $i -ge 0 ]; do
+        echo "        t$i: ^T$i"
+        i=$((i - 1))
+    done
+    echo "    }"
+    echo ")"
+} > "$out"
@@ -1 +1,2 @@
-cl /LD refl.c /Ferefl.umi
\ No newline at end of file
+@rem encodeParallel uses Win32 threads, which need no extra flag or library
+cl /LD refl.c /Ferefl.umi %*
@@ -1 +1 @@
-gcc refl.c -o refl.umi -shared -fPIO
+gcc refl.c -o refl.umi -shared -fPIC -pthread "$@"
@@ -2,8 +2,20 @@
 #include "umka_types.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 enum ReflTypeKind {
   RTK_INVALID,
   RTK_OTHER,
@@ -23,15 +35,71 @@ static const char *spelling[] = {
     "real32", "real",    "^",         "weak ^",  "[...]", "[]",    "str",
     "map",    "struct",  "interface", "fn |..|", "fiber", "fn"};
 
-#define FN(name, body)                                                         \
+#define RAW_FN(name, body)                                                     \
   UMKA_EXPORT void name(UmkaStackSlot *p, UmkaStackSlot *r) {                  \
     void *umka = umkaGetInstance(r);                                           \
     UmkaAPI *api = umkaGetAPI(umka);                                           \
+    (void)api;                                                                 \
+    (void)p;                                                                   \
+    body                                                                       \
+  }
+
+// Built with REFL_PROFILE, every export counts its calls, time and heap
+// growth, see the Profiling section
+#ifdef REFL_PROFILE
+#define FN(name, body)                                                         \
+  static void name##Body(void *umka, UmkaAPI *api, UmkaStackSlot *p,           \
+                         UmkaStackSlot *r) {                                   \
+    (void)umka;                                                                \
+    (void)api;                                                                 \
+    (void)p;                                                                   \
     body                                                                       \
+  }                                                                            \
+  UMKA_EXPORT void name(UmkaStackSlot *p, UmkaStackSlot *r) {                  \
+    static int profileId = -1;                                                 \
+    void *umka = umkaGetInstance(r);                                           \
+    UmkaAPI *api = umkaGetAPI(umka);                                           \
+    ProfileCall call;                                                          \
+    profileEnter(&call, &profileId, #name, umka, api);                         \
+    name##Body(umka, api, p, r);                                               \
+    profileLeave(&call);                                                       \
   }
+#define PROFILE_TYPE(type) profileNoteType(type)
+#else
+#define FN(name, body) RAW_FN(name, body)
+#define PROFILE_TYPE(type)
+#endif
 #define ARG(i) umkaGetParam(p, i)
 #define RET() umkaGetResult(p, r)
 
+struct Location {
+  const char *file;
+  int64_t line;
+};
+
+typedef struct {
+  const char *name;
+  int64_t value;
+} EnumVariant;
+
+typedef struct {
+  const char *name;
+  void *type;
+} StructField;
+
+typedef struct {
+  const char *path;
+  int64_t offset, size;
+  int64_t kind;
+  int64_t count;
+} LayoutRow;
+
+typedef struct {
+  const char *name;
+  void *type;
+  int64_t entryOffset;
+} MethodItem;
+
 enum ReflTypeKind getTypeKind(Type *type) {
   if (type == NULL) {
     return RTK_INVALID;
@@ -57,6 +125,16 @@ enum ReflTypeKind getTypeKind(Type *type) {
 }
 
 // From Umka itself --
+static inline unsigned int hashStr(const char *str) {
+  unsigned int hash = 5381;
+  char ch;
+
+  while ((ch = *str++))
+    hash = ((hash << 5) + hash) + ch;
+
+  return hash;
+}
+
 static inline int64_t align(int64_t size, int64_t alignment) {
   return ((size + (alignment - 1)) / alignment) * alignment;
 }
@@ -169,247 +247,5255 @@ int typeSizeNoCheck(Type *type) {
   }
 }
 
-FN(reflGetTypeSize, {
-  Type *type = ARG(0)->ptrVal;
+// Profiling --
+//
+// Counters are kept per thread, so that recording a call takes no lock. Each
+// thread has one row for every export and a table of rows keyed by the
+// instance and the Type the call was about, which is the first type it looked
+// up in the cache. Heap growth is the change in umkaGetMemUsage over the call,
+// so memory the call freed is netted out and malloc'd cache data is not
+// counted. Readers take the lock only to walk the list of threads, so counts
+// read while other threads are busy are approximate.
 
-  RET()->uintVal = typeSizeNoCheck(type);
-})
+typedef struct {
+  int64_t calls, ns, bytes;
+} ProfileCounter;
 
-FN(reflGetTypeAlignment, {
-  Type *type = ARG(0)->ptrVal;
+#ifdef REFL_PROFILE
 
-  RET()->uintVal = typeAlignmentNoCheck(type);
-})
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
 
-FN(reflGetStructFieldOffset, {
-  Type *type = ARG(0)->ptrVal;
-  const char *fieldName = ARG(1)->ptrVal;
+enum { MAX_PROFILED_EXPORTS = 128 };
 
-  assert(type->kind == TYPE_STRUCT);
+typedef struct {
+  bool used;
+  void *umka;
+  Type *type;
+  ProfileCounter counter;
+} ProfileTypeRow;
 
-  for (int i = 0; i < type->numItems; i++) {
-    if (strcmp(type->field[i]->name, fieldName) == 0) {
-      RET()->intVal = type->field[i]->offset;
-      return;
-    }
-  }
+typedef struct ProfileThread {
+  ProfileCounter exports[MAX_PROFILED_EXPORTS];
+  ProfileTypeRow *types;
+  int64_t numTypeSlots, numTypes;
+  struct ProfileThread *next;
+} ProfileThread;
 
-  RET()->intVal = -1;
-})
+typedef struct ProfileCall {
+  int id;
+  void *umka;
+  UmkaAPI *api;
+  bool typeSeen;
+  Type *type;
+  int64_t start, heapBefore;
+  struct ProfileCall *outer;
+} ProfileCall;
 
-FN(reflGetTypeKind, {
-  Type *type = ARG(0)->ptrVal;
+static const char *profileNames[MAX_PROFILED_EXPORTS];
+static int numProfileNames;
+static ProfileThread *profileThreads;
 
-  // @TODO: Check if it's within the type array range
-  RET()->intVal = getTypeKind(type);
-})
+static THREAD_LOCAL ProfileThread *profileThread;
+static THREAD_LOCAL ProfileCall *profileCall;
 
-FN(reflGetTypeName, {
-  Type *type = ARG(0)->ptrVal;
+#ifdef _WIN32
+static SRWLOCK profileMutex = SRWLOCK_INIT;
+static void profileLock(void) { AcquireSRWLockExclusive(&profileMutex); }
+static void profileUnlock(void) { ReleaseSRWLockExclusive(&profileMutex); }
+#else
+static pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+static void profileLock(void) { pthread_mutex_lock(&profileMutex); }
+static void profileUnlock(void) { pthread_mutex_unlock(&profileMutex); }
+#endif
 
-  if (type->typeIdent) {
-    RET()->ptrVal = api->umkaMakeStr(umka, type->typeIdent->name);
-    return;
+static uint64_t hashPtr(const void *ptr);
+
+static int64_t profileNow(void) {
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (int64_t)((double)counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Gives the export a row, the same one for every thread, or -1 if the rows
+// have run out
+static int profileRegister(const char *name) {
+  profileLock();
+
+  int id = -1;
+  for (int i = 0; i < numProfileNames && id < 0; i++) {
+    if (strcmp(profileNames[i], name) == 0)
+      id = i;
   }
 
-  switch (getTypeKind(type)) {
-  case RTK_INVALID:
-    RET()->ptrVal = api->umkaMakeStr(umka, "invalid");
-    break;
-  case RTK_ENUM:
-    RET()->ptrVal = api->umkaMakeStr(umka, "");
-    break;
-  default:
-    RET()->ptrVal = api->umkaMakeStr(umka, spelling[type->kind]);
-    break;
+  if (id < 0 && numProfileNames < MAX_PROFILED_EXPORTS) {
+    id = numProfileNames++;
+    profileNames[id] = name;
   }
-})
 
-struct Location {
-  const char *file;
-  int64_t line;
-};
+  profileUnlock();
+  return id;
+}
 
-FN(reflGetTypeLocation, {
-  Type *type = ARG(0)->ptrVal;
+static ProfileThread *getProfileThread(void) {
+  if (profileThread == NULL) {
+    profileThread = calloc(1, sizeof(ProfileThread));
 
-  struct Location loc;
+    profileLock();
+    profileThread->next = profileThreads;
+    profileThreads = profileThread;
+    profileUnlock();
+  }
 
-  if (type->typeIdent == NULL) {
-    loc.file = api->umkaMakeStr(umka, "?");
-    loc.line = 0;
+  return profileThread;
+}
 
-    *(struct Location *)RET()->ptrVal = loc;
-    return;
-  }
+// The table is only ever replaced under the lock, so that readers never walk
+// one that has been freed
+static void growProfileTypes(ProfileThread *thread) {
+  int64_t numSlots = thread->numTypeSlots ? thread->numTypeSlots * 2 : 64;
+  ProfileTypeRow *rows = calloc(numSlots, sizeof(ProfileTypeRow));
 
-  loc.file = api->umkaMakeStr(umka, type->typeIdent->debug.fileName);
-  loc.line = type->typeIdent->debug.line;
+  for (int64_t i = 0; i < thread->numTypeSlots; i++) {
+    ProfileTypeRow *row = &thread->types[i];
+    if (!row->used)
+      continue;
 
-  *(struct Location *)RET()->ptrVal = loc;
-})
+    uint64_t j = hashPtr(row->type) & (numSlots - 1);
+    while (rows[j].used)
+      j = (j + 1) & (numSlots - 1);
+    rows[j] = *row;
+  }
 
-FN(reflGetEnumVariantName, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->isEnum);
+  profileLock();
+  ProfileTypeRow *old = thread->types;
+  thread->types = rows;
+  thread->numTypeSlots = numSlots;
+  profileUnlock();
 
-  EnumConst *c = NULL;
+  free(old);
+}
 
-  for (int i = 0; i < type->numItems; i++) {
-    if (type->enumConst[i]->val.intVal == ARG(1)->intVal) {
-      c = type->enumConst[i];
-      break;
+static ProfileCounter *getProfileTypeRow(ProfileThread *thread, void *umka,
+                                         Type *type) {
+  if (thread->numTypes * 2 >= thread->numTypeSlots)
+    growProfileTypes(thread);
+
+  uint64_t mask = thread->numTypeSlots - 1;
+  for (uint64_t i = hashPtr(type) & mask;; i = (i + 1) & mask) {
+    ProfileTypeRow *row = &thread->types[i];
+    if (!row->used) {
+      row->umka = umka;
+      row->type = type;
+      row->used = true;
+      thread->numTypes++;
+      return &row->counter;
     }
+    if (row->umka == umka && row->type == type)
+      return &row->counter;
   }
+}
 
-  // @TODO: Error checking.
-  if (!c) {
-    RET()->ptrVal = api->umkaMakeStr(umka, "?");
-    return;
+static void profileEnter(ProfileCall *call, int *id, const char *name,
+                         void *umka, UmkaAPI *api) {
+  if (*id < 0)
+    *id = profileRegister(name);
+
+  call->id = *id;
+  call->umka = umka;
+  call->api = api;
+  call->typeSeen = false;
+  call->type = NULL;
+  call->outer = profileCall;
+  profileCall = call;
+
+  call->heapBefore = api->umkaGetMemUsage(umka);
+  call->start = profileNow();
+}
+
+static void profileLeave(ProfileCall *call) {
+  int64_t ns = profileNow() - call->start;
+  int64_t bytes = call->api->umkaGetMemUsage(call->umka) - call->heapBefore;
+  if (bytes < 0)
+    bytes = 0;
+
+  profileCall = call->outer;
+
+  ProfileThread *thread = getProfileThread();
+  if (call->id >= 0) {
+    ProfileCounter *counter = &thread->exports[call->id];
+    counter->calls++;
+    counter->ns += ns;
+    counter->bytes += bytes;
   }
 
-  RET()->ptrVal = api->umkaMakeStr(umka, c->name);
-})
+  if (call->type) {
+    ProfileCounter *counter = getProfileTypeRow(thread, call->umka, call->type);
+    counter->calls++;
+    counter->ns += ns;
+    counter->bytes += bytes;
+  }
+}
+
+static void profileNoteType(Type *type) {
+  if (profileCall && !profileCall->typeSeen) {
+    profileCall->typeSeen = true;
+    profileCall->type = type;
+  }
+}
+
+// Types of a freed instance may be reused by the next one, so its rows are
+// taken out of every table. They stay in place to keep the probe chains whole.
+static void profileForget(void *umka) {
+  profileLock();
+
+  for (ProfileThread *thread = profileThreads; thread; thread = thread->next) {
+    for (int64_t i = 0; i < thread->numTypeSlots; i++) {
+      if (thread->types[i].umka == umka) {
+        thread->types[i].umka = NULL;
+        memset(&thread->types[i].counter, 0, sizeof(ProfileCounter));
+      }
+    }
+  }
+
+  profileUnlock();
+}
+
+#endif
+
+// Per-instance cache --
+//
+// Everything reflection hands out for a type is built once and kept in a
+// TypeInfo, keyed by the Type pointer. The cache itself lives in a chunk
+// allocated on the Umka heap, so it is released together with the instance.
+
+typedef struct ValuePlan ValuePlan;
 
 typedef struct {
-  const char *name;
-  int64_t value;
-} EnumVariant;
+  Type *type;
+  enum ReflTypeKind kind;
+  int64_t size, alignment;
+  char *name;
+  struct Location location;
+  // Struct fields, closure params or interface methods, built on first use
+  UmkaDynArray(StructField) items;
+  UmkaDynArray(EnumVariant) variants;
+  UmkaDynArray(LayoutRow) layout;
+  // Field name lookup, indexed by Field.hash, stores field index + 1
+  int *fieldSlots;
+  int numFieldSlots;
+  // Enum constants by value and by name hash, see Enum lookup
+  struct EnumTable *enumTable;
+  ValuePlan *plan;
+  // Methods sorted by name, with a lookup table indexed by the name hash that
+  // stores method index + 1
+  bool methodsBuilt;
+  Ident **methodIdents;
+  int numMethods;
+  int *methodSlots;
+  int numMethodSlots;
+  UmkaDynArray(MethodItem) methods;
+  // Structural hash, kept unless it depended on a type being hashed above it
+  bool hashed;
+  uint64_t typeHash;
+  // Migrations into this struct type, one for every older version
+  struct MigrationPlan *migrations;
+} TypeInfo;
 
-FN(reflGetEnumVariants, {
-  Type *type = ARG(0)->ptrVal;
-  Type *enumvarianttype = ARG(1)->ptrVal;
-  assert(type->isEnum);
+// Answers about pairs of types, such as whether one implements the other
+enum PairRelation { PAIR_IMPLEMENTS = 1, PAIR_IMPLICIT, PAIR_EXPLICIT };
+
+typedef struct {
+  Type *left, *right;
+  enum PairRelation relation;
+  bool result;
+} PairEntry;
 
-  UmkaDynArray(EnumVariant) *result = RET()->ptrVal;
+// A name copied into the instance, owned by the cache
+typedef struct {
+  char *str;
+  unsigned int hash;
+} InternEntry;
 
-  api->umkaMakeDynArray(umka, result, enumvarianttype, type->numItems);
+typedef struct ReflCache {
+  void *umka;
+  UmkaAPI *api;
+  TypeInfo **slots;
+  int64_t numSlots, numTypes;
+  PairEntry *pairs;
+  int64_t numPairSlots, numPairs;
+  InternEntry *interned;
+  int64_t numInternSlots, numInterned;
+} ReflCache;
 
-  for (int i = 0; i < type->numItems; i++) {
-    result->data[i].name = api->umkaMakeStr(umka, type->enumConst[i]->name);
-    result->data[i].value = type->enumConst[i]->val.intVal;
+static uint64_t hashPtr(const void *ptr) {
+  uint64_t x = (uintptr_t)ptr;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static void growCache(ReflCache *cache) {
+  int64_t numSlots = cache->numSlots ? cache->numSlots * 2 : 64;
+  TypeInfo **slots = calloc(numSlots, sizeof(TypeInfo *));
+
+  for (int64_t i = 0; i < cache->numSlots; i++) {
+    TypeInfo *info = cache->slots[i];
+    if (info == NULL)
+      continue;
+
+    uint64_t j = hashPtr(info->type) & (numSlots - 1);
+    while (slots[j])
+      j = (j + 1) & (numSlots - 1);
+    slots[j] = info;
   }
-})
 
-typedef struct {
-  const char *name;
-  void *type;
-} StructField;
+  free(cache->slots);
+  cache->slots = slots;
+  cache->numSlots = numSlots;
+}
 
-FN(reflGetStructFields, {
-  Type *type = ARG(0)->ptrVal;
-  Type *structfieldtype = ARG(1)->ptrVal;
-  assert(type->kind == TYPE_STRUCT);
+static void growInterned(ReflCache *cache) {
+  int64_t numSlots = cache->numInternSlots ? cache->numInternSlots * 2 : 256;
+  InternEntry *entries = calloc(numSlots, sizeof(InternEntry));
+
+  for (int64_t i = 0; i < cache->numInternSlots; i++) {
+    InternEntry *entry = &cache->interned[i];
+    if (entry->str == NULL)
+      continue;
 
-  UmkaDynArray(StructField) *result = RET()->ptrVal;
+    uint64_t j = entry->hash & (numSlots - 1);
+    while (entries[j].str)
+      j = (j + 1) & (numSlots - 1);
+    entries[j] = *entry;
+  }
+
+  free(cache->interned);
+  cache->interned = entries;
+  cache->numInternSlots = numSlots;
+}
 
-  api->umkaMakeDynArray(umka, result, structfieldtype, type->numItems);
+// Identifier and file names are copied into an Umka string once per
+// instance. The string stays owned by the cache, so results must share() it.
+static char *intern(ReflCache *cache, const char *str) {
+  if (cache->numInterned * 2 >= cache->numInternSlots)
+    growInterned(cache);
 
-  for (int i = 0; i < type->numItems; i++) {
-    result->data[i].name = api->umkaMakeStr(umka, type->field[i]->name);
-    result->data[i].type = type->field[i]->type;
+  unsigned int hash = hashStr(str);
+  uint64_t mask = cache->numInternSlots - 1;
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    InternEntry *entry = &cache->interned[i];
+    if (entry->str == NULL) {
+      entry->str = cache->api->umkaMakeStr(cache->umka, str);
+      entry->hash = hash;
+      cache->numInterned++;
+      return entry->str;
+    }
+    if (entry->hash == hash && strcmp(entry->str, str) == 0)
+      return entry->str;
   }
-})
+}
 
-FN(reflGetClosureReturn, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->kind == TYPE_FN || type->kind == TYPE_CLOSURE);
+static const char *typeName(Type *type) {
+  if (type == NULL)
+    return "invalid";
+  if (type->typeIdent)
+    return type->typeIdent->name;
+  if (type->isEnum)
+    return "";
+  return spelling[type->kind];
+}
 
-  if (type->kind == TYPE_CLOSURE) {
-    RET()->ptrVal = type->field[0]->type->sig.resultType;
+static TypeInfo *buildTypeInfo(ReflCache *cache, Type *type) {
+  TypeInfo *info = calloc(1, sizeof(TypeInfo));
+  info->type = type;
+  info->kind = getTypeKind(type);
+  info->name = intern(cache, typeName(type));
+
+  if (type) {
+    info->size = typeSizeNoCheck(type);
+    info->alignment = typeAlignmentNoCheck(type);
+  }
+
+  if (type && type->typeIdent) {
+    info->location.file = intern(cache, type->typeIdent->debug.fileName);
+    info->location.line = type->typeIdent->debug.line;
   } else {
-    RET()->ptrVal = type->sig.resultType;
+    info->location.file = intern(cache, "?");
+    info->location.line = 0;
   }
-})
 
-FN(reflGetClosureParams, {
-  Type *type = ARG(0)->ptrVal;
-  Type *structfieldtype = ARG(1)->ptrVal;
-  assert(type->kind == TYPE_FN || type->kind == TYPE_CLOSURE);
+  return info;
+}
 
-  UmkaDynArray(StructField) *result = RET()->ptrVal;
+static TypeInfo *getTypeInfo(ReflCache *cache, Type *type) {
+  PROFILE_TYPE(type);
 
-  if (type->kind == TYPE_CLOSURE) {
-    api->umkaMakeDynArray(umka, result, structfieldtype,
-                          type->field[0]->type->sig.numParams - 1);
+  if (cache->numTypes * 2 >= cache->numSlots)
+    growCache(cache);
 
-    for (int i = 1; i < type->field[0]->type->sig.numParams; i++) {
-      result->data[i - 1].name =
-          api->umkaMakeStr(umka, type->field[0]->type->sig.param[i]->name);
-      result->data[i - 1].type = type->field[0]->type->sig.param[i]->type;
+  uint64_t mask = cache->numSlots - 1;
+  for (uint64_t i = hashPtr(type) & mask;; i = (i + 1) & mask) {
+    if (cache->slots[i] == NULL) {
+      cache->slots[i] = buildTypeInfo(cache, type);
+      cache->numTypes++;
+      return cache->slots[i];
     }
-  } else {
-    api->umkaMakeDynArray(umka, result, structfieldtype, type->sig.numParams);
+    if (cache->slots[i]->type == type)
+      return cache->slots[i];
+  }
+}
 
-    for (int i = 0; i < type->sig.numParams; i++) {
-      result->data[i].name = api->umkaMakeStr(umka, type->sig.param[i]->name);
-      result->data[i].type = type->sig.param[i]->type;
-    }
+// Hands out another reference to a cached Umka string or dynarray
+static void *share(ReflCache *cache, void *ptr) {
+  if (ptr)
+    cache->api->umkaIncRef(cache->umka, ptr);
+  return ptr;
+}
+
+static void release(ReflCache *cache, void *ptr) {
+  if (ptr)
+    cache->api->umkaDecRef(cache->umka, ptr);
+}
+
+static void freePlan(ValuePlan *plan);
+static void freeEnumTable(struct EnumTable *table);
+static void freeMethods(ReflCache *cache, TypeInfo *info);
+static void freeMigrations(struct MigrationPlan *plan);
+
+// Called by Umka with the chunk's data pointer in the first slot
+static void freeCache(UmkaStackSlot *p, UmkaStackSlot *r) {
+  (void)r;
+  ReflCache *cache = p[0].ptrVal;
+
+  for (int64_t i = 0; i < cache->numSlots; i++) {
+    TypeInfo *info = cache->slots[i];
+    if (info == NULL)
+      continue;
+
+    release(cache, info->items.data);
+    release(cache, info->variants.data);
+    release(cache, info->layout.data);
+    free(info->fieldSlots);
+    freeEnumTable(info->enumTable);
+    freePlan(info->plan);
+    freeMethods(cache, info);
+    freeMigrations(info->migrations);
+    free(info);
   }
+
+  for (int64_t i = 0; i < cache->numInternSlots; i++)
+    release(cache, cache->interned[i].str);
+
+  free(cache->slots);
+  free(cache->pairs);
+  free(cache->interned);
+
+#ifdef REFL_PROFILE
+  profileForget(cache->umka);
+#endif
+}
+
+FN(reflNewCache, {
+  ReflCache *cache = api->umkaAllocData(umka, sizeof(ReflCache), freeCache);
+  memset(cache, 0, sizeof(ReflCache));
+  cache->umka = umka;
+  cache->api = api;
+
+  RET()->ptrVal = cache;
 })
 
-FN(reflClosureIsMethod, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->kind == TYPE_CLOSURE || type->kind == TYPE_FN);
+// Type identity --
+//
+// Follows Umka's typeEquivalent: named types are only equivalent to
+// themselves, everything else is compared structurally. Pointer cycles are
+// broken by remembering the pairs currently being compared.
 
-  if (type->kind == TYPE_CLOSURE) {
-    RET()->intVal = type->field[0]->type->sig.isMethod;
-  } else {
-    RET()->intVal = type->sig.isMethod;
+static bool typeEquivalentRecursive(Type *left, Type *right,
+                                    VisitedTypePair *visited);
+
+static bool signatureEquivalent(Signature *left, Signature *right, int first,
+                                VisitedTypePair *visited) {
+  if (left->numParams != right->numParams ||
+      left->numDefaultParams != right->numDefaultParams ||
+      left->isMethod != right->isMethod)
+    return false;
+
+  for (int i = first; i < left->numParams; i++) {
+    if (!typeEquivalentRecursive(left->param[i]->type, right->param[i]->type,
+                                 visited))
+      return false;
   }
-})
 
-FN(reflClosureHasUpvalues, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->kind == TYPE_FN || type->kind == TYPE_CLOSURE);
+  return typeEquivalentRecursive(left->resultType, right->resultType, visited);
+}
 
-  RET()->intVal = type->kind == TYPE_CLOSURE;
+static bool typeEquivalentRecursive(Type *left, Type *right,
+                                    VisitedTypePair *visited) {
+  if (left == right)
+    return true;
+  if (left == NULL || right == NULL)
+    return false;
+  if (left->typeIdent || right->typeIdent)
+    return left->typeIdent == right->typeIdent;
+  if (left->kind != right->kind)
+    return false;
+
+  switch (left->kind) {
+  case TYPE_PTR:
+  case TYPE_WEAKPTR: {
+    for (VisitedTypePair *pair = visited; pair; pair = pair->next) {
+      if (pair->left == left && pair->right == right)
+        return true;
+    }
+
+    VisitedTypePair pair = {left, right, visited};
+    return typeEquivalentRecursive(left->base, right->base, &pair);
+  }
+  case TYPE_ARRAY:
+    return left->numItems == right->numItems &&
+           typeEquivalentRecursive(left->base, right->base, visited);
+  case TYPE_DYNARRAY:
+  case TYPE_MAP:
+    return typeEquivalentRecursive(left->base, right->base, visited);
+  case TYPE_STRUCT:
+  case TYPE_INTERFACE:
+  case TYPE_CLOSURE:
+    if (left->numItems != right->numItems ||
+        left->isExprList != right->isExprList)
+      return false;
+
+    for (int i = 0; i < left->numItems; i++) {
+      if (left->field[i]->hash != right->field[i]->hash ||
+          strcmp(left->field[i]->name, right->field[i]->name) != 0 ||
+          !typeEquivalentRecursive(left->field[i]->type, right->field[i]->type,
+                                   visited))
+        return false;
+    }
+    return true;
+  case TYPE_FN:
+    return signatureEquivalent(&left->sig, &right->sig, 0, visited);
+  default:
+    return true;
+  }
+}
+
+static bool typeEquivalent(Type *left, Type *right) {
+  return typeEquivalentRecursive(left, right, NULL);
+}
+
+FN(reflGetTypeSize, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+
+  RET()->uintVal = getTypeInfo(cache, type)->size;
 })
 
-FN(reflGetInterfaceMethods, {
-  Type *type = ARG(0)->ptrVal;
-  Type *structfieldtype = ARG(1)->ptrVal;
-  assert(type->kind == TYPE_INTERFACE);
+FN(reflGetTypeAlignment, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
 
-  UmkaDynArray(StructField) *result = RET()->ptrVal;
+  RET()->uintVal = getTypeInfo(cache, type)->alignment;
+})
+
+// Struct layout --
+//
+// A struct is flattened into one row per leaf, descending into nested
+// structs, so that "rect.pos.x" can be reached by index rather than by
+// walking the type tree. A fixed array is a single row giving the size and
+// kind of its items and their count, nested arrays included, so a [1000]int
+// doesn't turn into a thousand rows.
 
-  api->umkaMakeDynArray(umka, result, structfieldtype, type->numItems - 2);
+typedef struct {
+  LayoutRow *rows;
+  int64_t len, cap;
+} LayoutBuilder;
 
-  for (int i = 2; i < type->numItems; i++) {
-    result->data[i - 2].name = api->umkaMakeStr(umka, type->field[i]->name);
-    result->data[i - 2].type = type->field[i]->type;
+static void addLayoutRow(ReflCache *cache, LayoutBuilder *b, const char *path,
+                         int64_t offset, Type *type, int64_t count) {
+  if (b->len == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 16;
+    b->rows = realloc(b->rows, b->cap * sizeof(LayoutRow));
   }
-})
 
-FN(reflGetUnderlyingType, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->kind == TYPE_PTR || type->kind == TYPE_ARRAY ||
-         type->kind == TYPE_DYNARRAY || type->kind == TYPE_MAP);
+  LayoutRow *row = &b->rows[b->len++];
+  row->path = cache->api->umkaMakeStr(cache->umka, path);
+  row->offset = offset;
+  row->size = getTypeInfo(cache, type)->size;
+  row->kind = type->kind;
+  row->count = count;
+}
 
-  if (type->kind == TYPE_MAP) {
-    RET()->ptrVal = type->base->field[2]->type->base;
+// Overly long paths are truncated rather than overflowing the buffer
+static int clampPathLen(int len, int cap) { return len < cap ? len : cap - 1; }
+
+static void flattenType(ReflCache *cache, LayoutBuilder *b, Type *type,
+                        int64_t offset, char *path, int pathLen, int pathCap) {
+  if (type->kind == TYPE_STRUCT) {
+    for (int i = 0; i < type->numItems; i++) {
+      int len = snprintf(path + pathLen, pathCap - pathLen,
+                         pathLen ? ".%s" : "%s", type->field[i]->name);
+      flattenType(cache, b, type->field[i]->type,
+                  offset + type->field[i]->offset, path,
+                  clampPathLen(pathLen + len, pathCap), pathCap);
+    }
+  } else if (type->kind == TYPE_ARRAY) {
+    int64_t count = 1;
+    for (; type->kind == TYPE_ARRAY; type = type->base)
+      count *= type->numItems;
+    addLayoutRow(cache, b, path, offset, type, count);
   } else {
-    RET()->ptrVal = type->base;
+    addLayoutRow(cache, b, path, offset, type, 1);
   }
-})
 
-FN(reflPointerIsWeak, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->kind == TYPE_PTR || type->kind == TYPE_WEAKPTR);
+  path[pathLen] = 0;
+}
 
-  RET()->intVal = type->kind == TYPE_WEAKPTR;
-})
+FN(reflGetStructLayout, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  Type *layoutrowtype = ARG(2)->ptrVal;
+  assert(type->kind == TYPE_STRUCT);
 
-FN(reflGetArraySize, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->kind == TYPE_ARRAY);
+  TypeInfo *info = getTypeInfo(cache, type);
 
-  RET()->uintVal = type->numItems;
+  if (info->layout.data == NULL) {
+    LayoutBuilder b = {0};
+    char path[1024] = {0};
+    flattenType(cache, &b, type, 0, path, 0, sizeof(path));
+
+    api->umkaMakeDynArray(umka, &info->layout, layoutrowtype, b.len);
+    if (b.len > 0)
+      memcpy(info->layout.data, b.rows, b.len * sizeof(LayoutRow));
+    free(b.rows);
+  }
+
+  share(cache, info->layout.data);
+  memcpy(RET()->ptrVal, &info->layout, sizeof(DynArray));
 })
 
-FN(reflGetMapKeyType, {
-  Type *type = ARG(0)->ptrVal;
-  assert(type->kind == TYPE_MAP);
+// Field lookup --
+//
+// Umka already stores the hash of every field name, so the lookup table only
+// needs to be filled with indices once per type.
 
-  RET()->ptrVal = type->base->field[1]->type->base;
-})
\ No newline at end of file
+static void buildFieldSlots(TypeInfo *info) {
+  Type *type = info->type;
+
+  info->numFieldSlots = 8;
+  while (info->numFieldSlots < type->numItems * 2)
+    info->numFieldSlots *= 2;
+  info->fieldSlots = calloc(info->numFieldSlots, sizeof(int));
+
+  int mask = info->numFieldSlots - 1;
+  for (int i = 0; i < type->numItems; i++) {
+    int j = type->field[i]->hash & mask;
+    while (info->fieldSlots[j])
+      j = (j + 1) & mask;
+    info->fieldSlots[j] = i + 1;
+  }
+}
+
+static int findField(ReflCache *cache, Type *type, const char *name) {
+  TypeInfo *info = getTypeInfo(cache, type);
+  if (info->fieldSlots == NULL)
+    buildFieldSlots(info);
+
+  unsigned int hash = hashStr(name);
+  int mask = info->numFieldSlots - 1;
+
+  for (int j = hash & mask; info->fieldSlots[j]; j = (j + 1) & mask) {
+    Field *field = type->field[info->fieldSlots[j] - 1];
+    if (field->hash == hash && strcmp(field->name, name) == 0)
+      return info->fieldSlots[j] - 1;
+  }
+
+  return -1;
+}
+
+FN(reflGetStructFieldIndex, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  const char *fieldName = ARG(2)->ptrVal;
+  assert(type->kind == TYPE_STRUCT);
+
+  RET()->intVal = findField(cache, type, fieldName);
+})
+
+FN(reflGetStructFieldOffset, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  const char *fieldName = ARG(2)->ptrVal;
+  assert(type->kind == TYPE_STRUCT);
+
+  int i = findField(cache, type, fieldName);
+
+  RET()->intVal = i < 0 ? -1 : type->field[i]->offset;
+})
+
+// Enum lookup --
+//
+// Constants are found by value through an array indexed by value - min when
+// the values are close enough together, or else by binary search over the
+// values sorted, and by name through a table indexed by EnumConst.hash. All
+// of them store constant index + 1, and the first of several constants with
+// the same value wins, as with a linear search.
+
+typedef struct {
+  int64_t value;
+  int index;
+} EnumValue;
+
+typedef struct EnumTable {
+  int64_t min;
+  int *byValue;
+  int64_t numValues;
+  EnumValue *sorted;
+  int *nameSlots;
+  int numNameSlots;
+} EnumTable;
+
+static void freeEnumTable(EnumTable *table) {
+  if (table == NULL)
+    return;
+
+  free(table->byValue);
+  free(table->sorted);
+  free(table->nameSlots);
+  free(table);
+}
+
+static int compareEnumValues(const void *a, const void *b) {
+  const EnumValue *x = a, *y = b;
+  if (x->value != y->value)
+    return (x->value > y->value) - (x->value < y->value);
+  return x->index - y->index;
+}
+
+static EnumTable *buildEnumTable(Type *type) {
+  EnumTable *table = calloc(1, sizeof(EnumTable));
+  int count = type->numItems;
+
+  int64_t min = 0;
+  int64_t max = 0;
+  for (int i = 0; i < count; i++) {
+    int64_t value = type->enumConst[i]->val.intVal;
+    if (i == 0 || value < min)
+      min = value;
+    if (i == 0 || value > max)
+      max = value;
+  }
+
+  uint64_t range = (uint64_t)max - (uint64_t)min;
+  if (count > 0 && range < (uint64_t)count * 2 + 8) {
+    table->min = min;
+    table->numValues = range + 1;
+    table->byValue = calloc(table->numValues, sizeof(int));
+
+    for (int i = count - 1; i >= 0; i--)
+      table->byValue[type->enumConst[i]->val.intVal - min] = i + 1;
+  } else if (count > 0) {
+    table->sorted = malloc(count * sizeof(EnumValue));
+    for (int i = 0; i < count; i++) {
+      table->sorted[i].value = type->enumConst[i]->val.intVal;
+      table->sorted[i].index = i;
+    }
+    qsort(table->sorted, count, sizeof(EnumValue), compareEnumValues);
+  }
+
+  table->numNameSlots = 8;
+  while (table->numNameSlots < count * 2)
+    table->numNameSlots *= 2;
+  table->nameSlots = calloc(table->numNameSlots, sizeof(int));
+
+  int mask = table->numNameSlots - 1;
+  for (int i = 0; i < count; i++) {
+    int j = type->enumConst[i]->hash & mask;
+    while (table->nameSlots[j])
+      j = (j + 1) & mask;
+    table->nameSlots[j] = i + 1;
+  }
+
+  return table;
+}
+
+static EnumTable *getEnumTable(ReflCache *cache, Type *type) {
+  TypeInfo *info = getTypeInfo(cache, type);
+  if (info->enumTable == NULL)
+    info->enumTable = buildEnumTable(type);
+  return info->enumTable;
+}
+
+// Index of the first constant with the value, or -1
+static int findEnumValue(ReflCache *cache, Type *type, int64_t value) {
+  EnumTable *table = getEnumTable(cache, type);
+
+  if (table->byValue) {
+    uint64_t i = (uint64_t)value - (uint64_t)table->min;
+    return i < (uint64_t)table->numValues ? table->byValue[i] - 1 : -1;
+  }
+
+  int lo = 0;
+  int hi = type->numItems;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (table->sorted[mid].value < value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < type->numItems && table->sorted[lo].value == value)
+    return table->sorted[lo].index;
+  return -1;
+}
+
+// Index of the constant with the name, or -1
+static int findEnumName(ReflCache *cache, Type *type, const char *name) {
+  EnumTable *table = getEnumTable(cache, type);
+
+  unsigned int hash = hashStr(name);
+  int mask = table->numNameSlots - 1;
+
+  for (int j = hash & mask; table->nameSlots[j]; j = (j + 1) & mask) {
+    EnumConst *c = type->enumConst[table->nameSlots[j] - 1];
+    if (c->hash == hash && strcmp(c->name, name) == 0)
+      return table->nameSlots[j] - 1;
+  }
+
+  return -1;
+}
+
+typedef struct {
+  int64_t value;
+  bool ok;
+} ParseResult;
+
+FN(reflParseEnum, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  const char *name = ARG(2)->ptrVal;
+  assert(type->isEnum);
+
+  ParseResult *result = RET()->ptrVal;
+  int i = findEnumName(cache, type, name);
+
+  result->ok = i >= 0;
+  result->value = i >= 0 ? type->enumConst[i]->val.intVal : 0;
+})
+
+FN(reflGetTypeKind, {
+  Type *type = ARG(0)->ptrVal;
+
+  // @TODO: Check if it's within the type array range
+  RET()->intVal = getTypeKind(type);
+})
+
+FN(reflGetTypeName, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+
+  RET()->ptrVal = share(cache, getTypeInfo(cache, type)->name);
+})
+
+FN(reflGetTypeLocation, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+
+  struct Location loc = getTypeInfo(cache, type)->location;
+  share(cache, (void *)loc.file);
+
+  *(struct Location *)RET()->ptrVal = loc;
+})
+
+FN(reflGetEnumVariantName, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  assert(type->isEnum);
+
+  int i = findEnumValue(cache, type, ARG(2)->intVal);
+
+  // @TODO: Error checking.
+  const char *name = i >= 0 ? type->enumConst[i]->name : "?";
+  RET()->ptrVal = share(cache, intern(cache, name));
+})
+
+FN(reflGetEnumVariants, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  Type *enumvarianttype = ARG(2)->ptrVal;
+  assert(type->isEnum);
+
+  TypeInfo *info = getTypeInfo(cache, type);
+
+  if (info->variants.data == NULL) {
+    api->umkaMakeDynArray(umka, &info->variants, enumvarianttype,
+                          type->numItems);
+
+    for (int i = 0; i < type->numItems; i++) {
+      info->variants.data[i].name =
+          share(cache, intern(cache, type->enumConst[i]->name));
+      info->variants.data[i].value = type->enumConst[i]->val.intVal;
+    }
+  }
+
+  share(cache, info->variants.data);
+  memcpy(RET()->ptrVal, &info->variants, sizeof(DynArray));
+})
+
+// Fills info->items from a list of fields or params, skipping the first few
+static void buildItems(ReflCache *cache, TypeInfo *info, Type *itemstype,
+                       int skip) {
+  Type *type = info->type;
+  Signature *sig = NULL;
+  int count = type->numItems;
+
+  if (type->kind == TYPE_CLOSURE) {
+    sig = &type->field[0]->type->sig;
+    count = sig->numParams;
+  } else if (type->kind == TYPE_FN) {
+    sig = &type->sig;
+    count = sig->numParams;
+  }
+
+  cache->api->umkaMakeDynArray(cache->umka, &info->items, itemstype,
+                               count - skip);
+
+  for (int i = skip; i < count; i++) {
+    const char *name = sig ? sig->param[i]->name : type->field[i]->name;
+    info->items.data[i - skip].name = share(cache, intern(cache, name));
+    info->items.data[i - skip].type =
+        sig ? sig->param[i]->type : type->field[i]->type;
+  }
+}
+
+static void returnItems(ReflCache *cache, TypeInfo *info, UmkaStackSlot *r) {
+  share(cache, info->items.data);
+  memcpy(r->ptrVal, &info->items, sizeof(DynArray));
+}
+
+FN(reflGetStructFields, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  Type *structfieldtype = ARG(2)->ptrVal;
+  assert(type->kind == TYPE_STRUCT);
+
+  TypeInfo *info = getTypeInfo(cache, type);
+
+  if (info->items.data == NULL)
+    buildItems(cache, info, structfieldtype, 0);
+
+  returnItems(cache, info, RET());
+})
+
+FN(reflGetClosureReturn, {
+  Type *type = ARG(0)->ptrVal;
+  assert(type->kind == TYPE_FN || type->kind == TYPE_CLOSURE);
+
+  if (type->kind == TYPE_CLOSURE) {
+    RET()->ptrVal = type->field[0]->type->sig.resultType;
+  } else {
+    RET()->ptrVal = type->sig.resultType;
+  }
+})
+
+FN(reflGetClosureParams, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  Type *structfieldtype = ARG(2)->ptrVal;
+  assert(type->kind == TYPE_FN || type->kind == TYPE_CLOSURE);
+
+  TypeInfo *info = getTypeInfo(cache, type);
+
+  // Closures carry their upvalues as the first parameter
+  if (info->items.data == NULL)
+    buildItems(cache, info, structfieldtype, type->kind == TYPE_CLOSURE);
+
+  returnItems(cache, info, RET());
+})
+
+FN(reflClosureIsMethod, {
+  Type *type = ARG(0)->ptrVal;
+  assert(type->kind == TYPE_CLOSURE || type->kind == TYPE_FN);
+
+  if (type->kind == TYPE_CLOSURE) {
+    RET()->intVal = type->field[0]->type->sig.isMethod;
+  } else {
+    RET()->intVal = type->sig.isMethod;
+  }
+})
+
+FN(reflClosureHasUpvalues, {
+  Type *type = ARG(0)->ptrVal;
+  assert(type->kind == TYPE_FN || type->kind == TYPE_CLOSURE);
+
+  RET()->intVal = type->kind == TYPE_CLOSURE;
+})
+
+FN(reflGetInterfaceMethods, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  Type *structfieldtype = ARG(2)->ptrVal;
+  assert(type->kind == TYPE_INTERFACE);
+
+  TypeInfo *info = getTypeInfo(cache, type);
+
+  // The first two fields are the interface's self and selfType
+  if (info->items.data == NULL)
+    buildItems(cache, info, structfieldtype, 2);
+
+  returnItems(cache, info, RET());
+})
+
+FN(reflGetUnderlyingType, {
+  Type *type = ARG(0)->ptrVal;
+  assert(type->kind == TYPE_PTR || type->kind == TYPE_ARRAY ||
+         type->kind == TYPE_DYNARRAY || type->kind == TYPE_MAP);
+
+  if (type->kind == TYPE_MAP) {
+    RET()->ptrVal = type->base->field[2]->type->base;
+  } else {
+    RET()->ptrVal = type->base;
+  }
+})
+
+FN(reflPointerIsWeak, {
+  Type *type = ARG(0)->ptrVal;
+  assert(type->kind == TYPE_PTR || type->kind == TYPE_WEAKPTR);
+
+  RET()->intVal = type->kind == TYPE_WEAKPTR;
+})
+
+FN(reflGetArraySize, {
+  Type *type = ARG(0)->ptrVal;
+  assert(type->kind == TYPE_ARRAY);
+
+  RET()->uintVal = type->numItems;
+})
+
+FN(reflGetMapKeyType, {
+  Type *type = ARG(0)->ptrVal;
+  assert(type->kind == TYPE_MAP);
+
+  RET()->ptrVal = type->base->field[1]->type->base;
+})
+
+// Module types --
+//
+// Umka appends every global identifier to one list as it compiles, starting
+// with the built-in ones of the universe. Walking the list forward from the
+// identifier of a built-in type therefore sees every module, whichever order
+// they were compiled in.
+
+// Compares file names with the directory and the .um extension stripped, so
+// that "game/player.um", "player.um" and "player" all name the same module.
+static size_t moduleNameLen(const char *name, const char **start) {
+  const char *base = name;
+  for (const char *p = name; *p; p++) {
+    if (*p == '/' || *p == '\\')
+      base = p + 1;
+  }
+
+  size_t len = strlen(base);
+  if (len > 3 && strcmp(base + len - 3, ".um") == 0)
+    len -= 3;
+
+  *start = base;
+  return len;
+}
+
+static bool isModuleFile(const char *fileName, const char *moduleName) {
+  if (fileName == NULL)
+    return false;
+
+  const char *file, *module;
+  size_t fileLen = moduleNameLen(fileName, &file);
+  size_t moduleLen = moduleNameLen(moduleName, &module);
+  return fileLen == moduleLen && memcmp(file, module, fileLen) == 0;
+}
+
+// Finds the index of a module in Umka's module table, which is what
+// identifiers record as their module. The name is matched against the file
+// of an identifier exactly first, then against the alias of an import, and
+// only then without the directory and extension, so that two modules with
+// the same file name in different directories can be told apart. Returns -1
+// if nothing matches.
+static int findModule(Ident *first, const char *moduleName) {
+  int byAlias = -1;
+  int byBaseName = -1;
+
+  for (Ident *ident = first; ident; ident = ident->next) {
+    const char *fileName = ident->debug.fileName;
+    if (fileName && strcmp(fileName, moduleName) == 0)
+      return ident->module;
+
+    if (byAlias < 0 && ident->kind == IDENT_MODULE &&
+        strcmp(ident->name, moduleName) == 0)
+      byAlias = ident->moduleVal;
+    if (byBaseName < 0 && isModuleFile(fileName, moduleName))
+      byBaseName = ident->module;
+  }
+
+  return byAlias >= 0 ? byAlias : byBaseName;
+}
+
+typedef struct {
+  UmkaDynArray(Type *) types;
+  bool ok;
+} ModuleTypesResult;
+
+// builtin is a built-in type, whose identifier comes before those of any
+// module. Fails if no module goes by the name.
+FN(reflGetModuleTypes, {
+  Type *builtin = ARG(0)->ptrVal;
+  const char *moduleName = ARG(1)->ptrVal;
+  Type *voidptrarraytype = ARG(2)->ptrVal;
+  ModuleTypesResult *result = RET()->ptrVal;
+
+  Ident *first = builtin->typeIdent;
+  int module = first ? findModule(first, moduleName) : -1;
+  result->ok = module >= 0;
+  if (!result->ok) {
+    api->umkaMakeDynArray(umka, &result->types, voidptrarraytype, 0);
+    return;
+  }
+
+  int64_t len = 0;
+  int64_t capacity = 64;
+  Type **types = malloc(capacity * sizeof(Type *));
+
+  for (Ident *ident = first; ident; ident = ident->next) {
+    if (ident->kind != IDENT_TYPE || ident->block != 0 ||
+        ident->module != module)
+      continue;
+
+    if (len == capacity) {
+      capacity *= 2;
+      types = realloc(types, capacity * sizeof(Type *));
+    }
+    types[len++] = ident->type;
+  }
+
+  api->umkaMakeDynArray(umka, &result->types, voidptrarraytype, len);
+  if (len > 0)
+    memcpy(result->types.data, types, len * sizeof(Type *));
+  free(types);
+})
+
+// Methods --
+//
+// Umka has no per-type method table: methods are function constants whose
+// first parameter is the receiver. A receiver's base type must be declared in
+// the same module before its methods, so the identifiers following the type's
+// own are searched once and the result is kept sorted by name.
+
+static bool isMethodOf(Ident *ident, Type *type) {
+  if (ident->kind != IDENT_CONST || ident->block != 0 ||
+      ident->type->kind != TYPE_FN || !ident->type->sig.isMethod)
+    return false;
+
+  Type *receiver = ident->type->sig.param[0]->type;
+  if (receiver->kind == TYPE_PTR)
+    receiver = receiver->base;
+  return receiver == type;
+}
+
+static int compareMethodNames(const void *a, const void *b) {
+  return strcmp((*(Ident **)a)->name, (*(Ident **)b)->name);
+}
+
+static void buildMethods(TypeInfo *info) {
+  Type *type = info->type;
+  int capacity = 0;
+
+  if (type && type->typeIdent) {
+    for (Ident *ident = type->typeIdent->next; ident; ident = ident->next) {
+      if (!isMethodOf(ident, type))
+        continue;
+
+      if (info->numMethods == capacity) {
+        capacity = capacity ? capacity * 2 : 8;
+        info->methodIdents =
+            realloc(info->methodIdents, capacity * sizeof(Ident *));
+      }
+      info->methodIdents[info->numMethods++] = ident;
+    }
+  }
+
+  if (info->numMethods > 1)
+    qsort(info->methodIdents, info->numMethods, sizeof(Ident *),
+          compareMethodNames);
+
+  info->numMethodSlots = 8;
+  while (info->numMethodSlots < info->numMethods * 2)
+    info->numMethodSlots *= 2;
+  info->methodSlots = calloc(info->numMethodSlots, sizeof(int));
+
+  int mask = info->numMethodSlots - 1;
+  for (int i = 0; i < info->numMethods; i++) {
+    int j = info->methodIdents[i]->hash & mask;
+    while (info->methodSlots[j])
+      j = (j + 1) & mask;
+    info->methodSlots[j] = i + 1;
+  }
+
+  info->methodsBuilt = true;
+}
+
+// The method set of ^T is the one of T. An invalid type has none.
+static TypeInfo *getMethods(ReflCache *cache, Type *type) {
+  if (type && type->kind == TYPE_PTR)
+    type = type->base;
+
+  TypeInfo *info = getTypeInfo(cache, type);
+  if (!info->methodsBuilt)
+    buildMethods(info);
+  return info;
+}
+
+static int findMethod(TypeInfo *info, const char *name) {
+  unsigned int hash = hashStr(name);
+  int mask = info->numMethodSlots - 1;
+
+  for (int j = hash & mask; info->methodSlots[j]; j = (j + 1) & mask) {
+    Ident *ident = info->methodIdents[info->methodSlots[j] - 1];
+    if (ident->hash == hash && strcmp(ident->name, name) == 0)
+      return info->methodSlots[j] - 1;
+  }
+
+  return -1;
+}
+
+static void freeMethods(ReflCache *cache, TypeInfo *info) {
+  if (!info->methodsBuilt)
+    return;
+
+  release(cache, info->methods.data);
+  free(info->methodIdents);
+  free(info->methodSlots);
+}
+
+FN(reflGetMethods, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  Type *methodstype = ARG(2)->ptrVal;
+
+  TypeInfo *info = getMethods(cache, type);
+
+  if (info->methods.data == NULL) {
+    api->umkaMakeDynArray(umka, &info->methods, methodstype, info->numMethods);
+
+    for (int i = 0; i < info->numMethods; i++) {
+      Ident *ident = info->methodIdents[i];
+      info->methods.data[i].name = share(cache, intern(cache, ident->name));
+      info->methods.data[i].type = ident->type;
+      info->methods.data[i].entryOffset = ident->offset;
+    }
+  }
+
+  share(cache, info->methods.data);
+  memcpy(RET()->ptrVal, &info->methods, sizeof(DynArray));
+})
+
+FN(reflFindMethod, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  const char *name = ARG(2)->ptrVal;
+
+  RET()->intVal = findMethod(getMethods(cache, type), name);
+})
+
+// For hosts: the cache of the instance, made if the script hasn't used refl
+// yet, or NULL if the refl module can't be found. moduleName names the module
+// the way umkaGetFunc expects. The cache lives as long as the instance, so it
+// only needs to be looked up once.
+UMKA_EXPORT void *reflGetCache(void *umka, const char *moduleName) {
+  UmkaAPI *api = umkaGetAPI(umka);
+  UmkaFuncContext fn = {0};
+
+  if (!api->umkaGetFunc(umka, moduleName, "handle", &fn) ||
+      api->umkaCall(umka, &fn) != 0)
+    return NULL;
+
+  return umkaGetResult(fn.params, fn.result)->ptrVal;
+}
+
+// For hosts: prepares fn for calling a method of the given type, or a pointer
+// to it, by name. The receiver goes into the first parameter slot, the other
+// parameters follow. Fails if there is no such method.
+UMKA_EXPORT bool reflGetMethodContext(void *cacheHandle, void *type,
+                                      const char *name, UmkaFuncContext *fn) {
+  ReflCache *cache = cacheHandle;
+  if (cache == NULL || type == NULL)
+    return false;
+
+  TypeInfo *info = getMethods(cache, type);
+  int i = findMethod(info, name);
+  if (i < 0)
+    return false;
+
+  // umkaMakeFuncContext only reads the function type from the first field of
+  // the closure type it is given, so the method's own fn type is wrapped in
+  // one for the duration of the call
+  Field fnField = {0};
+  fnField.type = info->methodIdents[i]->type;
+  Field *fields[] = {&fnField};
+
+  Type closure = {0};
+  closure.kind = TYPE_CLOSURE;
+  closure.numItems = 1;
+  closure.field = fields;
+
+  cache->api->umkaMakeFuncContext(cache->umka, &closure,
+                                  info->methodIdents[i]->offset, fn);
+  return true;
+}
+
+// Pair cache --
+//
+// Checks involving two types are remembered by the pair of Type pointers and
+// the relation asked about, so that repeating one costs a single lookup.
+
+static uint64_t hashPair(Type *left, Type *right, enum PairRelation relation) {
+  return hashPtr(left) ^ (hashPtr(right) * 31) ^ relation;
+}
+
+static void growPairs(ReflCache *cache) {
+  int64_t numSlots = cache->numPairSlots ? cache->numPairSlots * 2 : 64;
+  PairEntry *pairs = calloc(numSlots, sizeof(PairEntry));
+
+  for (int64_t i = 0; i < cache->numPairSlots; i++) {
+    PairEntry *entry = &cache->pairs[i];
+    if (entry->relation == 0)
+      continue;
+
+    uint64_t j =
+        hashPair(entry->left, entry->right, entry->relation) & (numSlots - 1);
+    while (pairs[j].relation)
+      j = (j + 1) & (numSlots - 1);
+    pairs[j] = *entry;
+  }
+
+  free(cache->pairs);
+  cache->pairs = pairs;
+  cache->numPairSlots = numSlots;
+}
+
+// Returns the entry for the pair, which has relation 0 if it is not known yet
+static PairEntry *findPair(ReflCache *cache, Type *left, Type *right,
+                           enum PairRelation relation) {
+  if (cache->numPairs * 2 >= cache->numPairSlots)
+    growPairs(cache);
+
+  uint64_t mask = cache->numPairSlots - 1;
+  uint64_t i = hashPair(left, right, relation) & mask;
+  for (;; i = (i + 1) & mask) {
+    PairEntry *entry = &cache->pairs[i];
+    if (entry->relation == 0 || (entry->left == left &&
+                                 entry->right == right &&
+                                 entry->relation == relation))
+      return entry;
+  }
+}
+
+static void rememberPair(ReflCache *cache, PairEntry *entry, Type *left,
+                         Type *right, enum PairRelation relation,
+                         bool result) {
+  entry->left = left;
+  entry->right = right;
+  entry->relation = relation;
+  entry->result = result;
+  cache->numPairs++;
+}
+
+// Interface compatibility --
+//
+// Follows Umka's typeImplements: every method of the interface must be
+// present on the type under the same name, with an equivalent signature once
+// the receiver is left out. An interface satisfies another one by its own
+// method list.
+
+static bool implementsInterface(ReflCache *cache, Type *type, Type *iface) {
+  for (int i = 2; i < iface->numItems; i++) {
+    Field *wanted = iface->field[i];
+    Type *method = NULL;
+
+    if (type->kind == TYPE_INTERFACE) {
+      int j = findField(cache, type, wanted->name);
+      if (j >= 2)
+        method = type->field[j]->type;
+    } else {
+      TypeInfo *info = getMethods(cache, type);
+      int j = findMethod(info, wanted->name);
+      if (j >= 0)
+        method = info->methodIdents[j]->type;
+    }
+
+    if (method == NULL ||
+        !signatureEquivalent(&method->sig, &wanted->type->sig, 1, NULL))
+      return false;
+  }
+
+  return true;
+}
+
+static bool implements(ReflCache *cache, Type *type, Type *iface) {
+  if (type == NULL || iface == NULL || iface->kind != TYPE_INTERFACE)
+    return false;
+
+  PairEntry *entry = findPair(cache, type, iface, PAIR_IMPLEMENTS);
+  if (entry->relation)
+    return entry->result;
+
+  bool result = implementsInterface(cache, type, iface);
+  rememberPair(cache, entry, type, iface, PAIR_IMPLEMENTS, result);
+  return result;
+}
+
+FN(reflImplements, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+  Type *iface = ARG(2)->ptrVal;
+
+  RET()->intVal = implements(cache, type, iface);
+})
+
+// Values --
+//
+// Copying a value out of or into Umka memory has to keep reference counts
+// right: every heap pointer stored directly in the value (not behind another
+// pointer) gets one more reference.
+
+static void retainValue(ReflCache *cache, Type *type, char *data) {
+  switch (type->kind) {
+  case TYPE_PTR:
+  case TYPE_STR:
+  case TYPE_FIBER:
+    share(cache, *(void **)data);
+    break;
+  case TYPE_DYNARRAY:
+    share(cache, ((DynArray *)data)->data);
+    break;
+  case TYPE_MAP:
+    share(cache, ((Map *)data)->root);
+    break;
+  case TYPE_INTERFACE:
+    share(cache, ((Interface *)data)->self);
+    break;
+  case TYPE_CLOSURE:
+    share(cache, ((Closure *)data)->upvalue.self);
+    break;
+  case TYPE_ARRAY: {
+    int64_t itemSize = getTypeInfo(cache, type->base)->size;
+    for (int i = 0; i < type->numItems; i++)
+      retainValue(cache, type->base, data + i * itemSize);
+    break;
+  }
+  case TYPE_STRUCT:
+    for (int i = 0; i < type->numItems; i++)
+      retainValue(cache, type->field[i]->type, data + type->field[i]->offset);
+    break;
+  default:
+    break;
+  }
+}
+
+// The counterpart of retainValue. umkaDecRef does not know the type of the
+// chunk, so when it drops the last reference to a chunk, the references the
+// chunk itself holds are never given up: a released ^T, []T or the like
+// whose items hold strings or pointers leaks what those point to. Values that
+// may hold the last reference are better handed back to Umka to drop, as
+// setField and migrate do.
+static void releaseValue(ReflCache *cache, Type *type, char *data) {
+  switch (type->kind) {
+  case TYPE_PTR:
+  case TYPE_STR:
+  case TYPE_FIBER:
+    release(cache, *(void **)data);
+    break;
+  case TYPE_DYNARRAY:
+    release(cache, ((DynArray *)data)->data);
+    break;
+  case TYPE_MAP:
+    release(cache, ((Map *)data)->root);
+    break;
+  case TYPE_INTERFACE:
+    release(cache, ((Interface *)data)->self);
+    break;
+  case TYPE_CLOSURE:
+    release(cache, ((Closure *)data)->upvalue.self);
+    break;
+  case TYPE_ARRAY: {
+    int64_t itemSize = getTypeInfo(cache, type->base)->size;
+    for (int i = 0; i < type->numItems; i++)
+      releaseValue(cache, type->base, data + i * itemSize);
+    break;
+  }
+  case TYPE_STRUCT:
+    for (int i = 0; i < type->numItems; i++)
+      releaseValue(cache, type->field[i]->type, data + type->field[i]->offset);
+    break;
+  default:
+    break;
+  }
+}
+
+// Wraps a copy of the value into an any, the same way Umka does: pointers are
+// stored as is, everything else is boxed on the heap.
+static Interface boxValue(ReflCache *cache, Type *type, char *data) {
+  Interface result = {NULL, type};
+
+  if (type->kind == TYPE_PTR) {
+    result.self = share(cache, *(void **)data);
+    return result;
+  }
+
+  int64_t size = getTypeInfo(cache, type)->size;
+  result.self = cache->api->umkaAllocData(cache->umka, size, NULL);
+  memcpy(result.self, data, size);
+  retainValue(cache, type, result.self);
+
+  return result;
+}
+
+// Fills in the interface value Umka makes when converting the value held in
+// item to iface: the same self and type, followed by the entry points of the
+// methods the interface lists. The type must implement iface.
+static void convertToInterface(ReflCache *cache, Type *iface, Interface *item,
+                               char *data) {
+  memcpy(data, item, sizeof(Interface));
+
+  TypeInfo *info = getMethods(cache, item->selfType);
+  for (int i = 2; i < iface->numItems; i++) {
+    Ident *method = info->methodIdents[findMethod(info, iface->field[i]->name)];
+    memcpy(data + iface->field[i]->offset, &method->offset, sizeof(int64_t));
+  }
+}
+
+// Resolves the struct behind an any holding either a struct or a pointer to
+// one. Returns NULL if there is none.
+static Type *unwrapStruct(Interface *value, char **data) {
+  Type *type = value->selfType;
+  *data = value->self;
+
+  if (type && type->kind == TYPE_PTR)
+    type = type->base;
+
+  if (type == NULL || type->kind != TYPE_STRUCT || *data == NULL)
+    return NULL;
+
+  return type;
+}
+
+FN(reflGetField, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+  int64_t index = ARG(2)->intVal;
+
+  Interface result = {0};
+  char *data;
+  Type *type = unwrapStruct(value, &data);
+
+  if (type && index >= 0 && index < type->numItems) {
+    Field *field = type->field[index];
+    result = boxValue(cache, field->type, data + field->offset);
+  }
+
+  *(Interface *)RET()->ptrVal = result;
+})
+
+// Natives that overwrite a value hand the old one back in this, for Umka to
+// drop, rather than release it with releaseValue
+typedef struct {
+  Interface old;
+  bool ok;
+} ReplaceResult;
+
+// The old value of the field is returned rather than released here, so that
+// Umka, which knows its type, releases everything it holds once it's dropped
+FN(reflSetField, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+  int64_t index = ARG(2)->intVal;
+  Interface *item = (Interface *)ARG(3);
+
+  ReplaceResult *result = RET()->ptrVal;
+  memset(result, 0, sizeof(*result));
+
+  char *data;
+  Type *type = unwrapStruct(value, &data);
+
+  // Only a pointer gives access to the original struct, not a boxed copy
+  if (type == NULL || value->selfType->kind != TYPE_PTR || index < 0 ||
+      index >= type->numItems)
+    return;
+
+  Field *field = type->field[index];
+
+  // An interface field takes any value whose type implements it
+  bool convert = field->type->kind == TYPE_INTERFACE &&
+                 implements(cache, item->selfType, field->type);
+  if (!convert && !typeEquivalent(field->type, item->selfType))
+    return;
+
+  char *dst = data + field->offset;
+
+  // The box takes over the references the field held
+  result->old = boxValue(cache, field->type, dst);
+  releaseValue(cache, field->type, dst);
+
+  if (convert) {
+    convertToInterface(cache, field->type, item, dst);
+    share(cache, item->self);
+  } else {
+    char *src =
+        field->type->kind == TYPE_PTR ? (char *)&item->self : item->self;
+    retainValue(cache, field->type, src);
+    memcpy(dst, src, getTypeInfo(cache, field->type)->size);
+  }
+
+  result->ok = true;
+})
+
+// Value plans --
+//
+// A plan is a flat list of operations describing where the interesting parts
+// of a value are. Plain data is coalesced into as few copy operations as the
+// layout allows, so a struct of numbers becomes a single memcpy. Anything
+// behind a pointer is described by the plan of its own type, which is looked
+// up when the plan runs, so recursive types need no special handling.
+//
+// Equality and hashing can't treat reals as bytes: -0.0 equals 0.0 and NaN
+// equals nothing. A type holding reals gets a second plan for them, where
+// each real is an op of its own.
+
+enum PlanOpKind {
+  OP_COPY,   // Plain bytes
+  OP_REAL,   // A real or real32, only in compare plans
+  OP_OPAQUE, // Bytes that only mean something inside this instance
+  OP_STR,
+  OP_PTR,
+  OP_DYNARRAY,
+  OP_MAP,
+  OP_ARRAY, // Fixed array of items that are not plain bytes
+  OP_INTERFACE,
+  OP_CLOSURE,
+  OP_FIBER
+};
+
+typedef struct {
+  enum PlanOpKind kind;
+  int64_t offset, size;
+  Type *type;
+} PlanOp;
+
+struct ValuePlan {
+  PlanOp *ops;
+  int numOps, capOps;
+  bool isPod;    // No strings, pointers, dynarrays, maps or interfaces
+  bool hasReals; // Held directly or by items, so not comparable as bytes
+  ValuePlan *compare; // The plan itself if it has no reals
+};
+
+static void freePlan(ValuePlan *plan) {
+  if (plan == NULL)
+    return;
+
+  if (plan->compare != plan)
+    freePlan(plan->compare);
+  free(plan->ops);
+  free(plan);
+}
+
+static void addPlanOp(ValuePlan *plan, enum PlanOpKind kind, int64_t offset,
+                      int64_t size, Type *type) {
+  if (size == 0)
+    return;
+
+  // Ops are emitted in offset order, so a gap between two copies can only be
+  // padding, which Umka keeps zeroed
+  PlanOp *last = plan->numOps ? &plan->ops[plan->numOps - 1] : NULL;
+  if (kind == OP_COPY && last && last->kind == OP_COPY) {
+    last->size = offset + size - last->offset;
+    return;
+  }
+
+  if (plan->numOps == plan->capOps) {
+    plan->capOps = plan->capOps ? plan->capOps * 2 : 4;
+    plan->ops = realloc(plan->ops, plan->capOps * sizeof(PlanOp));
+  }
+
+  plan->ops[plan->numOps++] = (PlanOp){kind, offset, size, type};
+}
+
+static ValuePlan *getPlan(ReflCache *cache, Type *type);
+
+static Type *mapKeyType(Type *type) {
+  return type->base->field[MAP_NODE_FIELD_KEY]->type->base;
+}
+
+static Type *mapItemType(Type *type) {
+  return type->base->field[MAP_NODE_FIELD_DATA]->type->base;
+}
+
+static void compilePlan(ReflCache *cache, ValuePlan *plan, Type *type,
+                        int64_t offset, bool splitReals) {
+  int64_t size = getTypeInfo(cache, type)->size;
+
+  switch (type->kind) {
+  case TYPE_STR:
+    addPlanOp(plan, OP_STR, offset, size, type);
+    break;
+  case TYPE_PTR:
+    addPlanOp(plan, OP_PTR, offset, size, type);
+    break;
+  case TYPE_WEAKPTR:
+  case TYPE_FN:
+    addPlanOp(plan, OP_OPAQUE, offset, size, type);
+    break;
+  case TYPE_DYNARRAY:
+    plan->hasReals |= getPlan(cache, type->base)->hasReals;
+    addPlanOp(plan, OP_DYNARRAY, offset, size, type);
+    break;
+  case TYPE_MAP:
+    plan->hasReals |= getPlan(cache, mapKeyType(type))->hasReals ||
+                      getPlan(cache, mapItemType(type))->hasReals;
+    addPlanOp(plan, OP_MAP, offset, size, type);
+    break;
+  case TYPE_INTERFACE:
+    addPlanOp(plan, OP_INTERFACE, offset, size, type);
+    break;
+  case TYPE_CLOSURE:
+    addPlanOp(plan, OP_CLOSURE, offset, size, type);
+    break;
+  case TYPE_FIBER:
+    addPlanOp(plan, OP_FIBER, offset, size, type);
+    break;
+  case TYPE_ARRAY: {
+    ValuePlan *itemPlan = getPlan(cache, type->base);
+    plan->hasReals |= itemPlan->hasReals;
+    if (itemPlan->isPod && !(splitReals && itemPlan->hasReals))
+      addPlanOp(plan, OP_COPY, offset, size, type);
+    else
+      addPlanOp(plan, OP_ARRAY, offset, size, type);
+    break;
+  }
+  case TYPE_STRUCT:
+    for (int i = 0; i < type->numItems; i++)
+      compilePlan(cache, plan, type->field[i]->type,
+                  offset + type->field[i]->offset, splitReals);
+    break;
+  case TYPE_REAL32:
+  case TYPE_REAL:
+    plan->hasReals = true;
+    addPlanOp(plan, splitReals ? OP_REAL : OP_COPY, offset, size, type);
+    break;
+  default:
+    addPlanOp(plan, OP_COPY, offset, size, type);
+    break;
+  }
+}
+
+static ValuePlan *getPlan(ReflCache *cache, Type *type) {
+  TypeInfo *info = getTypeInfo(cache, type);
+
+  if (info->plan == NULL) {
+    info->plan = calloc(1, sizeof(ValuePlan));
+    compilePlan(cache, info->plan, type, 0, false);
+
+    // A value is plain data if its plan is a single copy. Take the trailing
+    // padding along too, so that it is a copy of the whole value.
+    PlanOp *op = info->plan->ops;
+    if (info->plan->numOps == 0) {
+      info->plan->isPod = true;
+    } else if (info->plan->numOps == 1 && op->kind == OP_COPY &&
+               op->offset == 0) {
+      op->size = info->size;
+      info->plan->isPod = true;
+    }
+
+    info->plan->compare = info->plan;
+    if (info->plan->hasReals) {
+      ValuePlan *compare = calloc(1, sizeof(ValuePlan));
+      compilePlan(cache, compare, type, 0, true);
+      compare->compare = compare;
+      info->plan->compare = compare;
+    }
+  }
+
+  return info->plan;
+}
+
+// Umka keeps the length in front of string and dynarray data. It is read
+// directly so that plans can run without calling back into the instance.
+static int64_t strLen(const char *str) {
+  return str ? ((StrDimensions *)str - 1)->len : 0;
+}
+
+static int64_t dynArrayDataLen(void *data) {
+  return data ? ((DynArrayDimensions *)data - 1)->len : 0;
+}
+
+static int64_t dynArrayLen(DynArray *array) {
+  return dynArrayDataLen(array->data);
+}
+
+// Growable byte buffer --
+
+typedef struct {
+  char *data;
+  int64_t len, cap;
+} ReflBuf;
+
+static void bufReserve(ReflBuf *buf, int64_t size) {
+  if (buf->len + size <= buf->cap)
+    return;
+
+  buf->cap = buf->cap ? buf->cap : 256;
+  while (buf->len + size > buf->cap)
+    buf->cap *= 2;
+  buf->data = realloc(buf->data, buf->cap);
+}
+
+static void bufWrite(ReflBuf *buf, const void *data, int64_t size) {
+  bufReserve(buf, size);
+  memcpy(buf->data + buf->len, data, size);
+  buf->len += size;
+}
+
+static void bufWriteInt(ReflBuf *buf, int64_t value) {
+  bufWrite(buf, &value, sizeof(value));
+}
+
+// Pointer maps --
+//
+// Open addressing keyed by pointer, with no way to remove a key. Putting a
+// key again replaces its value.
+
+typedef struct {
+  void **keys, **values;
+  int64_t len, cap;
+} PtrMap;
+
+static void *ptrMapGet(PtrMap *map, void *key) {
+  if (map->cap == 0)
+    return NULL;
+
+  uint64_t mask = map->cap - 1;
+  for (uint64_t i = hashPtr(key) & mask; map->keys[i]; i = (i + 1) & mask) {
+    if (map->keys[i] == key)
+      return map->values[i];
+  }
+  return NULL;
+}
+
+static void ptrMapPut(PtrMap *map, void *key, void *value) {
+  if (map->len * 2 >= map->cap) {
+    PtrMap grown = {0};
+    grown.cap = map->cap ? map->cap * 2 : 64;
+    grown.keys = calloc(grown.cap, sizeof(void *));
+    grown.values = calloc(grown.cap, sizeof(void *));
+
+    for (int64_t i = 0; i < map->cap; i++) {
+      if (map->keys[i])
+        ptrMapPut(&grown, map->keys[i], map->values[i]);
+    }
+
+    free(map->keys);
+    free(map->values);
+    *map = grown;
+  }
+
+  uint64_t mask = map->cap - 1;
+  uint64_t i = hashPtr(key) & mask;
+  while (map->keys[i] && map->keys[i] != key)
+    i = (i + 1) & mask;
+
+  if (map->keys[i] == NULL)
+    map->len++;
+  map->keys[i] = key;
+  map->values[i] = value;
+}
+
+static void freePtrMap(PtrMap *map) {
+  free(map->keys);
+  free(map->values);
+}
+
+// Value walks --
+//
+// Encoding and decoding go through values with an explicit stack of frames
+// rather than by recursion, so that a long chain of pointers or nested
+// dynarrays takes heap memory, not native stack. Only maps nest by recursion,
+// one level for every map on the way down. The pointers being walked through
+// are kept in path, which is how cycles are found.
+
+typedef struct {
+  Type *type;
+  char *data;
+  int op;
+  int64_t item; // Next item of the dynarray or array being walked
+  bool pointee; // Reached through a pointer, so data is on the path
+} WalkFrame;
+
+// A map entry read while decoding, which is only put into its map once the
+// whole value has been read
+typedef struct {
+  Map *map;
+  Type *mapType;
+  char *key, *item;
+} MapEntry;
+
+typedef struct {
+  WalkFrame *frames;
+  int64_t len, cap;
+  PtrMap path;
+  MapEntry *entries;
+  int64_t numEntries, capEntries;
+} Walk;
+
+// Fails if a pointee is already on the path
+static bool walkPush(Walk *walk, Type *type, char *data, bool pointee) {
+  if (pointee) {
+    if (ptrMapGet(&walk->path, data))
+      return false;
+    ptrMapPut(&walk->path, data, data);
+  }
+
+  if (walk->len == walk->cap) {
+    walk->cap = walk->cap ? walk->cap * 2 : 16;
+    walk->frames = realloc(walk->frames, walk->cap * sizeof(WalkFrame));
+  }
+
+  walk->frames[walk->len++] = (WalkFrame){type, data, 0, 0, pointee};
+  return true;
+}
+
+static void walkPop(Walk *walk) {
+  WalkFrame *frame = &walk->frames[--walk->len];
+  if (frame->pointee)
+    ptrMapPut(&walk->path, frame->data, NULL);
+}
+
+static void freeWalk(Walk *walk) {
+  free(walk->frames);
+  freePtrMap(&walk->path);
+  free(walk->entries);
+}
+
+// Binary encoding --
+//
+// Plain data is written as is, in native byte order. Strings are written as
+// a length, the bytes and a terminating zero; dynarrays and maps as an item
+// count followed by the items; pointers as a presence byte followed by the
+// value they point to. Pointers that form a cycle make encoding fail.
+// Interfaces, closures, fibers, functions and weak pointers can't be encoded.
+
+static bool encodeWalk(ReflCache *cache, ReflBuf *buf, Walk *walk,
+                       Type *type, char *data);
+
+static bool encodeMapNode(ReflCache *cache, ReflBuf *buf, Walk *walk,
+                          Type *type, MapNode *node, int64_t *count) {
+  if (node == NULL)
+    return true;
+
+  if (!encodeMapNode(cache, buf, walk, type, node->left, count))
+    return false;
+
+  if (node->key) {
+    if (!encodeWalk(cache, buf, walk, mapKeyType(type), node->key) ||
+        !encodeWalk(cache, buf, walk, mapItemType(type), node->data))
+      return false;
+    (*count)++;
+  }
+
+  return encodeMapNode(cache, buf, walk, type, node->right, count);
+}
+
+// Runs until the frames pushed for this value are done, leaving the ones
+// below alone
+static bool encodeWalk(ReflCache *cache, ReflBuf *buf, Walk *walk,
+                       Type *type, char *data) {
+  int64_t base = walk->len;
+  walkPush(walk, type, data, false);
+  bool ok = true;
+
+  while (ok && walk->len > base) {
+    // Pushing may move the frames, so the pointer is only good until then
+    WalkFrame *frame = &walk->frames[walk->len - 1];
+    ValuePlan *plan = getPlan(cache, frame->type);
+
+    if (frame->op == plan->numOps) {
+      walkPop(walk);
+      continue;
+    }
+
+    PlanOp *op = &plan->ops[frame->op];
+    char *item = frame->data + op->offset;
+
+    switch (op->kind) {
+    case OP_COPY:
+      bufWrite(buf, item, op->size);
+      frame->op++;
+      break;
+    case OP_STR: {
+      char *str = *(char **)item;
+      int64_t len = strLen(str);
+      bufWriteInt(buf, len);
+      bufWrite(buf, str ? str : "", len + 1);
+      frame->op++;
+      break;
+    }
+    case OP_PTR: {
+      char *ptr = *(char **)item;
+      uint8_t present = ptr != NULL;
+      bufWrite(buf, &present, 1);
+      frame->op++;
+      if (present)
+        ok = walkPush(walk, op->type->base, ptr, true);
+      break;
+    }
+    case OP_DYNARRAY: {
+      DynArray *array = (DynArray *)item;
+      int64_t len = dynArrayLen(array);
+
+      if (frame->item == 0) {
+        bufWriteInt(buf, len);
+        if (len > 0 && getPlan(cache, op->type->base)->isPod) {
+          bufWrite(buf, array->data, len * array->itemSize);
+          len = 0;
+        }
+      }
+
+      if (frame->item < len) {
+        char *next = (char *)array->data + frame->item++ * array->itemSize;
+        walkPush(walk, op->type->base, next, false);
+      } else {
+        frame->item = 0;
+        frame->op++;
+      }
+      break;
+    }
+    case OP_MAP: {
+      Map *map = (Map *)item;
+      int64_t countOffset = buf->len;
+      int64_t count = 0;
+      bufWriteInt(buf, 0);
+      frame->op++;
+
+      ok = map->root == NULL ||
+           encodeMapNode(cache, buf, walk, op->type, map->root, &count);
+      memcpy(buf->data + countOffset, &count, sizeof(count));
+      break;
+    }
+    case OP_ARRAY: {
+      int64_t itemSize = getTypeInfo(cache, op->type->base)->size;
+
+      if (frame->item < op->type->numItems) {
+        char *next = item + frame->item++ * itemSize;
+        walkPush(walk, op->type->base, next, false);
+      } else {
+        frame->item = 0;
+        frame->op++;
+      }
+      break;
+    }
+    default:
+      ok = false;
+      break;
+    }
+  }
+
+  while (walk->len > base)
+    walkPop(walk);
+  return ok;
+}
+
+static bool encodeValue(ReflCache *cache, ReflBuf *buf, Type *type,
+                        char *data) {
+  Walk walk = {0};
+  bool ok = encodeWalk(cache, buf, &walk, type, data);
+  freeWalk(&walk);
+  return ok;
+}
+
+typedef struct {
+  UmkaDynArray(uint8_t) bytes;
+  bool ok;
+} EncodeResult;
+
+FN(reflEncode, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+  Type *bytestype = ARG(2)->ptrVal;
+
+  EncodeResult *result = RET()->ptrVal;
+  ReflBuf buf = {0};
+  char *data = value->self;
+
+  // Pointers are stored in the interface itself, everything else is boxed
+  if (value->selfType && value->selfType->kind == TYPE_PTR)
+    data = (char *)&value->self;
+
+  result->ok = value->selfType != NULL &&
+               encodeValue(cache, &buf, value->selfType, data);
+
+  api->umkaMakeDynArray(umka, &result->bytes, bytestype,
+                        result->ok ? buf.len : 0);
+  if (result->ok && buf.len > 0)
+    memcpy(result->bytes.data, buf.data, buf.len);
+
+  free(buf.data);
+})
+
+// Binary decoding --
+//
+// Reads back what encodeValue wrote. Strings, dynarrays and pointers are
+// allocated on the Umka heap and filled in place; dynarrays of plain data are
+// filled with a single copy. Maps can't be created from outside Umka, so the
+// maps being decoded into must already exist. If decoding fails, the target
+// is left as it was, maps included.
+
+typedef struct {
+  const char *data;
+  int64_t len, pos;
+} ReflReader;
+
+static const char *readBytes(ReflReader *reader, int64_t size) {
+  if (size < 0 || reader->len - reader->pos < size)
+    return NULL;
+
+  const char *data = reader->data + reader->pos;
+  reader->pos += size;
+  return data;
+}
+
+static bool readInt(ReflReader *reader, int64_t *value) {
+  const char *data = readBytes(reader, sizeof(*value));
+  if (data)
+    memcpy(value, data, sizeof(*value));
+  return data != NULL;
+}
+
+// Puts a map key into a stack slot the way umkaGetMapItem expects it
+static UmkaStackSlot mapKeySlot(Type *type, char *key) {
+  UmkaStackSlot slot = {0};
+
+  switch (type->kind) {
+  case TYPE_INT8:
+    slot.intVal = *(int8_t *)key;
+    break;
+  case TYPE_INT16:
+    slot.intVal = *(int16_t *)key;
+    break;
+  case TYPE_INT32:
+    slot.intVal = *(int32_t *)key;
+    break;
+  case TYPE_INT:
+    slot.intVal = *(int64_t *)key;
+    break;
+  case TYPE_UINT8:
+  case TYPE_BOOL:
+  case TYPE_CHAR:
+    slot.uintVal = *(uint8_t *)key;
+    break;
+  case TYPE_UINT16:
+    slot.uintVal = *(uint16_t *)key;
+    break;
+  case TYPE_UINT32:
+    slot.uintVal = *(uint32_t *)key;
+    break;
+  case TYPE_UINT:
+  case TYPE_WEAKPTR:
+    slot.uintVal = *(uint64_t *)key;
+    break;
+  case TYPE_REAL32:
+    slot.real32Val = *(float *)key;
+    break;
+  case TYPE_REAL:
+    slot.realVal = *(double *)key;
+    break;
+  case TYPE_PTR:
+  case TYPE_STR:
+    slot.ptrVal = *(void **)key;
+    break;
+  default:
+    slot.ptrVal = key;
+    break;
+  }
+
+  return slot;
+}
+
+static bool decodeWalk(ReflCache *cache, ReflReader *reader, Walk *walk,
+                       Type *type, char *data);
+
+// Entries are decoded into memory of their own and kept in the walk, see
+// putMapEntries
+static bool decodeMap(ReflCache *cache, ReflReader *reader, Walk *walk,
+                      Type *type, Map *map) {
+  // A map that was never made can only stay empty
+  int64_t count;
+  if (!readInt(reader, &count) || (count > 0 && map->root == NULL))
+    return false;
+
+  Type *keyType = mapKeyType(type);
+  Type *itemType = mapItemType(type);
+  int64_t keySize = getTypeInfo(cache, keyType)->size;
+  int64_t itemSize = getTypeInfo(cache, itemType)->size;
+
+  for (int64_t i = 0; i < count; i++) {
+    if (walk->numEntries == walk->capEntries) {
+      walk->capEntries = walk->capEntries ? walk->capEntries * 2 : 16;
+      walk->entries =
+          realloc(walk->entries, walk->capEntries * sizeof(MapEntry));
+    }
+
+    MapEntry *entry = &walk->entries[walk->numEntries++];
+    entry->map = map;
+    entry->mapType = type;
+    entry->key = calloc(1, keySize > 0 ? keySize : 1);
+    entry->item = calloc(1, itemSize > 0 ? itemSize : 1);
+
+    // The entry pointer is not kept, as decoding the item may add entries
+    char *key = entry->key;
+    char *item = entry->item;
+    if (!decodeWalk(cache, reader, walk, keyType, key) ||
+        !decodeWalk(cache, reader, walk, itemType, item))
+      return false;
+  }
+
+  return true;
+}
+
+// Puts the entries a successful decode read into their maps, or drops them
+// all if it failed, so that maps are left as they were
+static void putMapEntries(ReflCache *cache, Walk *walk, bool ok) {
+  for (int64_t i = 0; i < walk->numEntries; i++) {
+    MapEntry *entry = &walk->entries[i];
+    Type *keyType = mapKeyType(entry->mapType);
+    Type *itemType = mapItemType(entry->mapType);
+
+    char *item = NULL;
+    if (ok)
+      item = cache->api->umkaGetMapItem(cache->umka, (UmkaMap *)entry->map,
+                                        mapKeySlot(keyType, entry->key));
+
+    if (item) {
+      releaseValue(cache, itemType, item);
+      memcpy(item, entry->item, getTypeInfo(cache, itemType)->size);
+    } else {
+      releaseValue(cache, itemType, entry->item);
+    }
+
+    releaseValue(cache, keyType, entry->key);
+    free(entry->key);
+    free(entry->item);
+  }
+
+  walk->numEntries = 0;
+}
+
+// The counterpart of encodeWalk. Everything is decoded into fresh memory, so
+// there are no cycles to look out for.
+static bool decodeWalk(ReflCache *cache, ReflReader *reader, Walk *walk,
+                       Type *type, char *data) {
+  int64_t base = walk->len;
+  walkPush(walk, type, data, false);
+  bool ok = true;
+
+  while (ok && walk->len > base) {
+    WalkFrame *frame = &walk->frames[walk->len - 1];
+    ValuePlan *plan = getPlan(cache, frame->type);
+
+    if (frame->op == plan->numOps) {
+      walkPop(walk);
+      continue;
+    }
+
+    PlanOp *op = &plan->ops[frame->op];
+    char *item = frame->data + op->offset;
+
+    switch (op->kind) {
+    case OP_COPY: {
+      const char *bytes = readBytes(reader, op->size);
+      ok = bytes != NULL;
+      if (ok)
+        memcpy(item, bytes, op->size);
+      frame->op++;
+      break;
+    }
+    case OP_STR: {
+      int64_t len;
+      const char *bytes = NULL;
+      ok = readInt(reader, &len) && (bytes = readBytes(reader, len + 1)) &&
+           bytes[len] == 0;
+      if (ok)
+        *(char **)item = cache->api->umkaMakeStr(cache->umka, bytes);
+      frame->op++;
+      break;
+    }
+    case OP_PTR: {
+      const char *present = readBytes(reader, 1);
+      ok = present != NULL;
+      frame->op++;
+      if (!ok || !*present) {
+        *(void **)item = NULL;
+        break;
+      }
+
+      int64_t size = getTypeInfo(cache, op->type->base)->size;
+      char *ptr = cache->api->umkaAllocData(cache->umka, size, NULL);
+      memset(ptr, 0, size);
+      *(void **)item = ptr;
+      walkPush(walk, op->type->base, ptr, false);
+      break;
+    }
+    case OP_DYNARRAY: {
+      DynArray *array = (DynArray *)item;
+
+      if (frame->item == 0) {
+        int64_t len;
+        ok = readInt(reader, &len) && len >= 0 && len <= reader->len;
+        if (!ok)
+          break;
+
+        cache->api->umkaMakeDynArray(cache->umka, array, op->type, len);
+
+        if (getPlan(cache, op->type->base)->isPod) {
+          const char *bytes = readBytes(reader, len * array->itemSize);
+          ok = bytes != NULL;
+          if (ok && len > 0)
+            memcpy(array->data, bytes, len * array->itemSize);
+          frame->op++;
+          break;
+        }
+      }
+
+      if (frame->item < dynArrayLen(array)) {
+        char *next = (char *)array->data + frame->item++ * array->itemSize;
+        walkPush(walk, op->type->base, next, false);
+      } else {
+        frame->item = 0;
+        frame->op++;
+      }
+      break;
+    }
+    case OP_MAP:
+      ok = decodeMap(cache, reader, walk, op->type, (Map *)item);
+      frame->op++;
+      break;
+    case OP_ARRAY: {
+      int64_t itemSize = getTypeInfo(cache, op->type->base)->size;
+
+      if (frame->item < op->type->numItems) {
+        char *next = item + frame->item++ * itemSize;
+        walkPush(walk, op->type->base, next, false);
+      } else {
+        frame->item = 0;
+        frame->op++;
+      }
+      break;
+    }
+    default:
+      ok = false;
+      break;
+    }
+  }
+
+  while (walk->len > base)
+    walkPop(walk);
+  return ok;
+}
+
+// Reads the whole input, and fails if anything is left over
+static bool decodeValue(ReflCache *cache, ReflReader *reader, Type *type,
+                        char *data) {
+  Walk walk = {0};
+  bool ok = decodeWalk(cache, reader, &walk, type, data) &&
+            reader->pos == reader->len;
+  putMapEntries(cache, &walk, ok);
+  freeWalk(&walk);
+  return ok;
+}
+
+// Maps can't be made here, so a value is decoded into a copy that shares the
+// maps of the original. Their entries are only put in once decoding succeeded.
+static void shareMaps(ReflCache *cache, Type *type, char *dst, char *src) {
+  ValuePlan *plan = getPlan(cache, type);
+
+  for (int i = 0; i < plan->numOps; i++) {
+    PlanOp *op = &plan->ops[i];
+
+    if (op->kind == OP_MAP) {
+      memcpy(dst + op->offset, src + op->offset, op->size);
+    } else if (op->kind == OP_ARRAY) {
+      int64_t itemSize = getTypeInfo(cache, op->type->base)->size;
+      for (int j = 0; j < op->type->numItems; j++)
+        shareMaps(cache, op->type->base, dst + op->offset + j * itemSize,
+                  src + op->offset + j * itemSize);
+    }
+  }
+}
+
+// Releases everything stored directly in the value except its maps
+static void releaseExceptMaps(ReflCache *cache, Type *type, char *data) {
+  ValuePlan *plan = getPlan(cache, type);
+
+  for (int i = 0; i < plan->numOps; i++) {
+    PlanOp *op = &plan->ops[i];
+
+    if (op->kind == OP_ARRAY) {
+      int64_t itemSize = getTypeInfo(cache, op->type->base)->size;
+      for (int j = 0; j < op->type->numItems; j++)
+        releaseExceptMaps(cache, op->type->base,
+                          data + op->offset + j * itemSize);
+    } else if (op->kind != OP_COPY && op->kind != OP_MAP) {
+      releaseValue(cache, op->type, data + op->offset);
+    }
+  }
+}
+
+// out must hold a pointer to a variable of the type being decoded
+FN(reflDecode, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  DynArray *bytes = (DynArray *)ARG(1);
+  Type *type = ARG(2)->ptrVal;
+  Interface *target = (Interface *)ARG(3);
+  char *out = target->self;
+
+  if (type == NULL || out == NULL || target->selfType == NULL ||
+      target->selfType->kind != TYPE_PTR ||
+      !typeEquivalent(target->selfType->base, type)) {
+    RET()->intVal = false;
+    return;
+  }
+
+  ReflReader reader = {0};
+  reader.data = bytes->data;
+  reader.len = dynArrayLen(bytes);
+
+  // The previous contents are replaced, not merged into, except for maps.
+  // out is only touched once the whole value has been read.
+  int64_t size = getTypeInfo(cache, type)->size;
+  char *copy = calloc(1, size > 0 ? size : 1);
+  shareMaps(cache, type, copy, out);
+
+  bool ok = decodeValue(cache, &reader, type, copy);
+
+  if (ok) {
+    releaseExceptMaps(cache, type, out);
+    memcpy(out, copy, size);
+  } else {
+    releaseExceptMaps(cache, type, copy);
+  }
+
+  free(copy);
+  RET()->intVal = ok;
+})
+
+// JSON encoding --
+//
+// Output goes into a buffer which, when a sink is given, is handed over in
+// chunks as it fills up, so large values never have to be held in memory at
+// once. Structs become objects, enums their variant names, maps objects when
+// the keys are strings, numbers, enums or characters, and arrays of
+// [key, value] pairs otherwise. Characters past ASCII are escaped as the
+// code point of the same value. Pointers that lead back into a value being
+// written, weak pointers, functions and fibers are written as null.
+
+enum { JSON_CHUNK_SIZE = 64 * 1024, MAX_JSON_DEPTH = 10000 };
+
+typedef bool (*ReflSinkFn)(void *context, const char *data, int64_t size);
+
+typedef struct {
+  ReflCache *cache;
+  ReflBuf buf;
+  ReflSinkFn sink;
+  void *sinkContext;
+  bool failed;
+  // Pointers on the path from the root to the value being written, each
+  // mapped to itself while it's there and to NULL after
+  PtrMap path;
+} JsonWriter;
+
+static void jsonFlush(JsonWriter *w) {
+  if (w->sink && w->buf.len > 0) {
+    if (!w->sink(w->sinkContext, w->buf.data, w->buf.len))
+      w->failed = true;
+    w->buf.len = 0;
+  }
+}
+
+static void jsonWrite(JsonWriter *w, const char *data, int64_t size) {
+  bufWrite(&w->buf, data, size);
+  if (w->buf.len >= JSON_CHUNK_SIZE)
+    jsonFlush(w);
+}
+
+static void jsonWriteStr(JsonWriter *w, const char *str, int64_t len) {
+  static const char hex[] = "0123456789abcdef";
+  int64_t start = 0;
+
+  jsonWrite(w, "\"", 1);
+
+  for (int64_t i = 0; i < len; i++) {
+    unsigned char ch = str[i];
+    if (ch >= 0x20 && ch != '"' && ch != '\\')
+      continue;
+
+    jsonWrite(w, str + start, i - start);
+    start = i + 1;
+
+    if (ch == '"' || ch == '\\') {
+      char escaped[2] = {'\\', ch};
+      jsonWrite(w, escaped, 2);
+    } else {
+      char escaped[6] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 15]};
+      jsonWrite(w, escaped, 6);
+    }
+  }
+
+  jsonWrite(w, str + start, len - start);
+  jsonWrite(w, "\"", 1);
+}
+
+static void jsonWriteNumber(JsonWriter *w, Type *type, char *data) {
+  char num[32];
+  int len = 0;
+
+  switch (type->kind) {
+  case TYPE_INT8:
+    len = snprintf(num, sizeof(num), "%d", *(int8_t *)data);
+    break;
+  case TYPE_INT16:
+    len = snprintf(num, sizeof(num), "%d", *(int16_t *)data);
+    break;
+  case TYPE_INT32:
+    len = snprintf(num, sizeof(num), "%d", *(int32_t *)data);
+    break;
+  case TYPE_INT:
+    len = snprintf(num, sizeof(num), "%lld", (long long)*(int64_t *)data);
+    break;
+  case TYPE_UINT8:
+    len = snprintf(num, sizeof(num), "%u", *(uint8_t *)data);
+    break;
+  case TYPE_UINT16:
+    len = snprintf(num, sizeof(num), "%u", *(uint16_t *)data);
+    break;
+  case TYPE_UINT32:
+    len = snprintf(num, sizeof(num), "%u", *(uint32_t *)data);
+    break;
+  case TYPE_UINT:
+    len = snprintf(num, sizeof(num), "%llu",
+                   (unsigned long long)*(uint64_t *)data);
+    break;
+  case TYPE_REAL32:
+  case TYPE_REAL: {
+    double val = type->kind == TYPE_REAL32 ? *(float *)data : *(double *)data;
+    // JSON has no NaN or infinity
+    if (val != val || val - val != 0)
+      len = snprintf(num, sizeof(num), "null");
+    else
+      len = snprintf(num, sizeof(num), "%.17g", val);
+    break;
+  }
+  default:
+    break;
+  }
+
+  jsonWrite(w, num, len);
+}
+
+static int64_t readInteger(Type *type, char *data) {
+  switch (type->kind) {
+  case TYPE_INT8:
+    return *(int8_t *)data;
+  case TYPE_INT16:
+    return *(int16_t *)data;
+  case TYPE_INT32:
+    return *(int32_t *)data;
+  case TYPE_UINT8:
+    return *(uint8_t *)data;
+  case TYPE_UINT16:
+    return *(uint16_t *)data;
+  case TYPE_UINT32:
+    return *(uint32_t *)data;
+  default:
+    return *(int64_t *)data;
+  }
+}
+
+static const char *enumName(ReflCache *cache, Type *type, int64_t value) {
+  int i = findEnumValue(cache, type, value);
+  return i >= 0 ? type->enumConst[i]->name : NULL;
+}
+
+static void jsonWriteValue(JsonWriter *w, Type *type, char *data, int depth);
+
+static bool jsonKeyIsScalar(Type *type) {
+  return type->isEnum || type->kind == TYPE_STR || type->kind == TYPE_CHAR ||
+         (type->kind >= TYPE_INT8 && type->kind <= TYPE_UINT);
+}
+
+static void jsonWriteMapNode(JsonWriter *w, Type *type, MapNode *node,
+                             bool *first, int depth) {
+  if (node == NULL || w->failed)
+    return;
+
+  jsonWriteMapNode(w, type, node->left, first, depth);
+
+  if (node->key) {
+    Type *keyType = mapKeyType(type);
+
+    if (!*first)
+      jsonWrite(w, ",", 1);
+    *first = false;
+
+    if (!jsonKeyIsScalar(keyType)) {
+      jsonWrite(w, "[", 1);
+      jsonWriteValue(w, keyType, node->key, depth);
+      jsonWrite(w, ",", 1);
+      jsonWriteValue(w, mapItemType(type), node->data, depth);
+      jsonWrite(w, "]", 1);
+    } else {
+      if (keyType->kind == TYPE_STR || keyType->kind == TYPE_CHAR ||
+          keyType->isEnum) {
+        jsonWriteValue(w, keyType, node->key, depth);
+      } else {
+        jsonWrite(w, "\"", 1);
+        jsonWriteNumber(w, keyType, node->key);
+        jsonWrite(w, "\"", 1);
+      }
+      jsonWrite(w, ":", 1);
+      jsonWriteValue(w, mapItemType(type), node->data, depth);
+    }
+  }
+
+  jsonWriteMapNode(w, type, node->right, first, depth);
+}
+
+static void jsonWriteItems(JsonWriter *w, Type *itemType, char *data,
+                           int64_t len, int64_t itemSize, int depth) {
+  jsonWrite(w, "[", 1);
+  for (int64_t i = 0; i < len; i++) {
+    if (i > 0)
+      jsonWrite(w, ",", 1);
+    jsonWriteValue(w, itemType, data + i * itemSize, depth);
+  }
+  jsonWrite(w, "]", 1);
+}
+
+static void jsonWritePointee(JsonWriter *w, Type *type, void *ptr, int depth) {
+  if (ptrMapGet(&w->path, ptr)) {
+    jsonWrite(w, "null", 4);
+    return;
+  }
+
+  ptrMapPut(&w->path, ptr, ptr);
+  jsonWriteValue(w, type, ptr, depth);
+  ptrMapPut(&w->path, ptr, NULL);
+}
+
+static void jsonWriteValue(JsonWriter *w, Type *type, char *data, int depth) {
+  if (w->failed)
+    return;
+
+  if (depth > MAX_JSON_DEPTH) {
+    w->failed = true;
+    return;
+  }
+
+  if (type->isEnum) {
+    int64_t value = readInteger(type, data);
+    const char *name = enumName(w->cache, type, value);
+    if (name)
+      jsonWriteStr(w, name, strlen(name));
+    else
+      jsonWriteNumber(w, type, data);
+    return;
+  }
+
+  switch (type->kind) {
+  case TYPE_INT8:
+  case TYPE_INT16:
+  case TYPE_INT32:
+  case TYPE_INT:
+  case TYPE_UINT8:
+  case TYPE_UINT16:
+  case TYPE_UINT32:
+  case TYPE_UINT:
+  case TYPE_REAL32:
+  case TYPE_REAL:
+    jsonWriteNumber(w, type, data);
+    break;
+  case TYPE_BOOL:
+    if (*(bool *)data)
+      jsonWrite(w, "true", 4);
+    else
+      jsonWrite(w, "false", 5);
+    break;
+  case TYPE_CHAR: {
+    // A lone byte past ASCII isn't valid UTF-8, so it's taken as Latin-1
+    static const char hex[] = "0123456789abcdef";
+    unsigned char ch = *data;
+    if (ch < 0x80) {
+      jsonWriteStr(w, data, 1);
+    } else {
+      char escaped[8] = {'"', '\\', 'u', '0',
+                         '0', hex[ch >> 4], hex[ch & 15], '"'};
+      jsonWrite(w, escaped, 8);
+    }
+    break;
+  }
+  case TYPE_STR: {
+    char *str = *(char **)data;
+    jsonWriteStr(w, str ? str : "", strLen(str));
+    break;
+  }
+  case TYPE_ARRAY: {
+    int64_t itemSize = getTypeInfo(w->cache, type->base)->size;
+    jsonWriteItems(w, type->base, data, type->numItems, itemSize, depth + 1);
+    break;
+  }
+  case TYPE_DYNARRAY: {
+    DynArray *array = (DynArray *)data;
+    jsonWriteItems(w, type->base, array->data, dynArrayLen(array),
+                   array->itemSize, depth + 1);
+    break;
+  }
+  case TYPE_MAP: {
+    Map *map = (Map *)data;
+    bool first = true;
+    bool asObject = jsonKeyIsScalar(mapKeyType(type));
+
+    jsonWrite(w, asObject ? "{" : "[", 1);
+    if (map->root)
+      jsonWriteMapNode(w, type, map->root, &first, depth + 1);
+    jsonWrite(w, asObject ? "}" : "]", 1);
+    break;
+  }
+  case TYPE_STRUCT:
+    jsonWrite(w, "{", 1);
+    for (int i = 0; i < type->numItems; i++) {
+      if (i > 0)
+        jsonWrite(w, ",", 1);
+      jsonWriteStr(w, type->field[i]->name, strlen(type->field[i]->name));
+      jsonWrite(w, ":", 1);
+      jsonWriteValue(w, type->field[i]->type, data + type->field[i]->offset,
+                     depth + 1);
+    }
+    jsonWrite(w, "}", 1);
+    break;
+  case TYPE_PTR: {
+    void *ptr = *(void **)data;
+    if (ptr == NULL || type->base->kind == TYPE_VOID)
+      jsonWrite(w, "null", 4);
+    else
+      jsonWritePointee(w, type->base, ptr, depth + 1);
+    break;
+  }
+  case TYPE_INTERFACE: {
+    Interface *value = (Interface *)data;
+    if (value->selfType == NULL)
+      jsonWrite(w, "null", 4);
+    else if (value->selfType->kind == TYPE_PTR)
+      jsonWriteValue(w, value->selfType, (char *)&value->self, depth + 1);
+    else
+      jsonWriteValue(w, value->selfType, value->self, depth + 1);
+    break;
+  }
+  default:
+    jsonWrite(w, "null", 4);
+    break;
+  }
+}
+
+// Writes the value held in an any and flushes what's left in the buffer
+static bool jsonWriteAny(JsonWriter *w, Interface *value) {
+  if (value->selfType == NULL)
+    jsonWrite(w, "null", 4);
+  else if (value->selfType->kind == TYPE_PTR)
+    jsonWriteValue(w, value->selfType, (char *)&value->self, 0);
+  else
+    jsonWriteValue(w, value->selfType, value->self, 0);
+
+  jsonFlush(w);
+  freePtrMap(&w->path);
+  return !w->failed;
+}
+
+static bool fileSink(void *context, const char *data, int64_t size) {
+  return fwrite(data, 1, size, context) == (size_t)size;
+}
+
+FN(reflToJson, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+
+  JsonWriter w = {0};
+  w.cache = cache;
+  bool ok = jsonWriteAny(&w, value);
+  bufWrite(&w.buf, "", 1);
+
+  RET()->ptrVal = api->umkaMakeStr(umka, ok ? w.buf.data : "");
+  free(w.buf.data);
+})
+
+FN(reflWriteJson, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  const char *path = ARG(1)->ptrVal;
+  Interface *value = (Interface *)ARG(2);
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    RET()->intVal = false;
+    return;
+  }
+
+  JsonWriter w = {0};
+  w.cache = cache;
+  w.sink = fileSink;
+  w.sinkContext = file;
+
+  bool ok = jsonWriteAny(&w, value);
+  ok = fclose(file) == 0 && ok;
+  free(w.buf.data);
+
+  RET()->intVal = ok;
+})
+
+// Text buffer --
+//
+// Backs the Umka-side Formatter. Text between line breaks is appended in bulk
+// and indentation is copied from a preallocated run of spaces.
+
+static const char indentSpaces[] = "                                "
+                                   "                                ";
+
+static void writeIndent(ReflBuf *buf, int64_t nesting) {
+  int64_t len = nesting * 4;
+
+  while (len > 0) {
+    int64_t chunk = len < (int64_t)sizeof(indentSpaces) - 1
+                        ? len
+                        : (int64_t)sizeof(indentSpaces) - 1;
+    bufWrite(buf, indentSpaces, chunk);
+    len -= chunk;
+  }
+}
+
+// Indentation is written lazily, right before the first character following
+// a line break. Returns whether it is still pending.
+static bool writeIndented(ReflBuf *buf, const char *str, int64_t len,
+                          int64_t nesting, bool indent) {
+  int64_t i = 0;
+
+  while (i < len) {
+    if (indent) {
+      writeIndent(buf, nesting);
+      indent = false;
+    }
+
+    const char *eol = memchr(str + i, '\n', len - i);
+    int64_t end = eol ? eol - str + 1 : len;
+
+    bufWrite(buf, str + i, end - i);
+    indent = eol != NULL;
+    i = end;
+  }
+
+  return indent;
+}
+
+// Called by Umka with the chunk's data pointer in the first slot
+static void freeTextBuf(UmkaStackSlot *p, UmkaStackSlot *r) {
+  (void)r;
+  ReflBuf *buf = p[0].ptrVal;
+  free(buf->data);
+}
+
+FN(reflNewTextBuf, {
+  ReflBuf *buf = api->umkaAllocData(umka, sizeof(ReflBuf), freeTextBuf);
+  memset(buf, 0, sizeof(ReflBuf));
+
+  RET()->ptrVal = buf;
+})
+
+FN(reflTextBufWrite, {
+  ReflBuf *buf = ARG(0)->ptrVal;
+  const char *str = ARG(1)->ptrVal;
+  int64_t nesting = ARG(2)->intVal;
+  bool indent = ARG(3)->intVal;
+
+  RET()->intVal = writeIndented(buf, str, strLen(str), nesting, indent);
+})
+
+// Hands the text over and empties the buffer
+FN(reflTextBufTake, {
+  ReflBuf *buf = ARG(0)->ptrVal;
+
+  bufReserve(buf, 1);
+  buf->data[buf->len] = 0;
+  buf->len = 0;
+
+  RET()->ptrVal = api->umkaMakeStr(umka, buf->data);
+})
+
+// Equality and hashing --
+//
+// Both walk values by their compare plans, so plain data is compared with
+// memcmp and hashed as one block, while reals are compared by value. Strings are compared by content, dynarrays and fixed
+// arrays item by item, and maps by walking both trees in order, which is
+// their key order. Pointers, fibers and closure upvalues are compared by
+// address, like Umka's == does.
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const char *p) {
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t lane) {
+  acc ^= hashRound(0, lane);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+// XXH64. Large blocks are consumed in 32 byte stripes by four independent
+// lanes, which keeps the loop free of dependencies between iterations.
+static uint64_t hashBytes(const void *data, int64_t len, uint64_t seed) {
+  const char *p = data;
+  const char *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+
+    for (; end - p >= 32; p += 32) {
+      v1 = hashRound(v1, read64(p));
+      v2 = hashRound(v2, read64(p + 8));
+      v3 = hashRound(v3, read64(p + 16));
+      v4 = hashRound(v4, read64(p + 24));
+    }
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = hashMerge(h, v1);
+    h = hashMerge(h, v2);
+    h = hashMerge(h, v3);
+    h = hashMerge(h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+
+  h += (uint64_t)len;
+
+  for (; end - p >= 8; p += 8) {
+    h ^= hashRound(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+
+  if (end - p >= 4) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    h ^= (uint64_t)x * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+
+  for (; p < end; p++) {
+    h ^= (uint8_t)*p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t hashInt(uint64_t value, uint64_t seed) {
+  return hashBytes(&value, sizeof(value), seed);
+}
+
+// Map nodes holding items, in order
+typedef struct {
+  MapNode **nodes;
+  int64_t len, cap;
+} MapNodeList;
+
+static void collectMapNodes(MapNodeList *list, MapNode *node) {
+  if (node == NULL)
+    return;
+
+  collectMapNodes(list, node->left);
+
+  if (node->key) {
+    if (list->len == list->cap) {
+      list->cap = list->cap ? list->cap * 2 : 16;
+      list->nodes = realloc(list->nodes, list->cap * sizeof(MapNode *));
+    }
+    list->nodes[list->len++] = node;
+  }
+
+  collectMapNodes(list, node->right);
+}
+
+static bool valuesEqual(ReflCache *cache, Type *type, char *left,
+                        char *right);
+
+static bool interfacesEqual(ReflCache *cache, Interface *left,
+                            Interface *right) {
+  if (left->selfType == NULL || right->selfType == NULL)
+    return left->selfType == right->selfType;
+  if (!typeEquivalent(left->selfType, right->selfType))
+    return false;
+  if (left->selfType->kind == TYPE_PTR)
+    return left->self == right->self;
+  return valuesEqual(cache, left->selfType, left->self, right->self);
+}
+
+static bool mapsEqual(ReflCache *cache, Type *type, Map *left, Map *right) {
+  MapNodeList l = {0}, r = {0};
+  collectMapNodes(&l, left->root);
+  collectMapNodes(&r, right->root);
+
+  bool equal = l.len == r.len;
+  for (int64_t i = 0; equal && i < l.len; i++) {
+    equal = valuesEqual(cache, mapKeyType(type), l.nodes[i]->key,
+                        r.nodes[i]->key) &&
+            valuesEqual(cache, mapItemType(type), l.nodes[i]->data,
+                        r.nodes[i]->data);
+  }
+
+  free(l.nodes);
+  free(r.nodes);
+  return equal;
+}
+
+static double readReal(Type *type, char *data) {
+  return type->kind == TYPE_REAL32 ? *(float *)data : *(double *)data;
+}
+
+static bool valuesEqual(ReflCache *cache, Type *type, char *left,
+                        char *right) {
+  ValuePlan *plan = getPlan(cache, type)->compare;
+
+  // A NaN is not equal to itself
+  if (left == right && !plan->hasReals)
+    return true;
+
+  for (int i = 0; i < plan->numOps; i++) {
+    PlanOp *op = &plan->ops[i];
+    char *l = left + op->offset;
+    char *r = right + op->offset;
+
+    switch (op->kind) {
+    case OP_COPY:
+    case OP_OPAQUE:
+    case OP_PTR:
+    case OP_FIBER:
+      if (memcmp(l, r, op->size) != 0)
+        return false;
+      break;
+    case OP_REAL:
+      if (readReal(op->type, l) != readReal(op->type, r))
+        return false;
+      break;
+    case OP_STR: {
+      char *ls = *(char **)l, *rs = *(char **)r;
+      int64_t len = strLen(ls);
+      if (len != strLen(rs) || (len > 0 && memcmp(ls, rs, len) != 0))
+        return false;
+      break;
+    }
+    case OP_DYNARRAY: {
+      DynArray *la = (DynArray *)l, *ra = (DynArray *)r;
+      int64_t len = dynArrayLen(la);
+      if (len != dynArrayLen(ra))
+        return false;
+
+      ValuePlan *itemPlan = getPlan(cache, op->type->base);
+      if (len == 0 || (la->data == ra->data && !itemPlan->hasReals))
+        break;
+
+      if (itemPlan->isPod && !itemPlan->hasReals) {
+        if (memcmp(la->data, ra->data, len * la->itemSize) != 0)
+          return false;
+        break;
+      }
+
+      for (int64_t j = 0; j < len; j++) {
+        if (!valuesEqual(cache, op->type->base,
+                         (char *)la->data + j * la->itemSize,
+                         (char *)ra->data + j * ra->itemSize))
+          return false;
+      }
+      break;
+    }
+    case OP_MAP: {
+      Map *lm = (Map *)l, *rm = (Map *)r;
+      bool same = lm->root == rm->root && !getPlan(cache, op->type)->hasReals;
+      if (!same && !mapsEqual(cache, op->type, lm, rm))
+        return false;
+      break;
+    }
+    case OP_ARRAY: {
+      int64_t itemSize = getTypeInfo(cache, op->type->base)->size;
+      for (int j = 0; j < op->type->numItems; j++) {
+        if (!valuesEqual(cache, op->type->base, l + j * itemSize,
+                         r + j * itemSize))
+          return false;
+      }
+      break;
+    }
+    case OP_INTERFACE:
+      if (!interfacesEqual(cache, (Interface *)l, (Interface *)r))
+        return false;
+      break;
+    case OP_CLOSURE: {
+      Closure *lc = (Closure *)l, *rc = (Closure *)r;
+      if (lc->entryOffset != rc->entryOffset ||
+          lc->upvalue.self != rc->upvalue.self)
+        return false;
+      break;
+    }
+    }
+  }
+
+  return true;
+}
+
+static uint64_t hashValue(ReflCache *cache, Type *type, char *data,
+                          uint64_t h);
+
+static uint64_t hashMapNode(ReflCache *cache, Type *type, MapNode *node,
+                            uint64_t h) {
+  if (node == NULL)
+    return h;
+
+  h = hashMapNode(cache, type, node->left, h);
+  if (node->key) {
+    h = hashValue(cache, mapKeyType(type), node->key, h);
+    h = hashValue(cache, mapItemType(type), node->data, h);
+  }
+  return hashMapNode(cache, type, node->right, h);
+}
+
+static uint64_t hashValue(ReflCache *cache, Type *type, char *data,
+                          uint64_t h) {
+  ValuePlan *plan = getPlan(cache, type)->compare;
+
+  for (int i = 0; i < plan->numOps; i++) {
+    PlanOp *op = &plan->ops[i];
+    char *item = data + op->offset;
+
+    switch (op->kind) {
+    case OP_COPY:
+    case OP_OPAQUE:
+    case OP_PTR:
+    case OP_FIBER:
+      h = hashBytes(item, op->size, h);
+      break;
+    case OP_REAL: {
+      // Equal values hash the same, so -0.0 becomes 0.0
+      double value = readReal(op->type, item);
+      if (value == 0)
+        value = 0;
+      h = hashBytes(&value, sizeof(value), h);
+      break;
+    }
+    case OP_STR: {
+      char *str = *(char **)item;
+      h = hashBytes(str, strLen(str), h);
+      break;
+    }
+    case OP_DYNARRAY: {
+      DynArray *array = (DynArray *)item;
+      int64_t len = dynArrayLen(array);
+      h = hashInt(len, h);
+
+      ValuePlan *itemPlan = getPlan(cache, op->type->base);
+      if (len > 0 && itemPlan->isPod && !itemPlan->hasReals) {
+        h = hashBytes(array->data, len * array->itemSize, h);
+        break;
+      }
+
+      for (int64_t j = 0; j < len; j++)
+        h = hashValue(cache, op->type->base,
+                      (char *)array->data + j * array->itemSize, h);
+      break;
+    }
+    case OP_MAP:
+      h = hashMapNode(cache, op->type, ((Map *)item)->root, h);
+      break;
+    case OP_ARRAY: {
+      int64_t itemSize = getTypeInfo(cache, op->type->base)->size;
+      for (int j = 0; j < op->type->numItems; j++)
+        h = hashValue(cache, op->type->base, item + j * itemSize, h);
+      break;
+    }
+    case OP_INTERFACE: {
+      Interface *value = (Interface *)item;
+      if (value->selfType == NULL)
+        h = hashInt(0, h);
+      else if (value->selfType->kind == TYPE_PTR)
+        h = hashInt((uintptr_t)value->self, h);
+      else
+        h = hashValue(cache, value->selfType, value->self, h);
+      break;
+    }
+    case OP_CLOSURE: {
+      Closure *closure = (Closure *)item;
+      h = hashInt(closure->entryOffset, h);
+      h = hashInt((uintptr_t)closure->upvalue.self, h);
+      break;
+    }
+    }
+  }
+
+  return h;
+}
+
+FN(reflEqual, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *left = (Interface *)ARG(1);
+  Interface *right = (Interface *)ARG(2);
+
+  RET()->intVal = interfacesEqual(cache, left, right);
+})
+
+FN(reflHash, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+
+  uint64_t h = 0;
+  if (value->selfType && value->selfType->kind == TYPE_PTR)
+    h = hashInt((uintptr_t)value->self, h);
+  else if (value->selfType)
+    h = hashValue(cache, value->selfType, value->self, h);
+
+  RET()->uintVal = h;
+})
+
+// Cloning --
+//
+// A clone starts as a byte copy of the value, after which the plan's
+// non-plain parts are fixed up: strings and fibers are shared, dynarrays,
+// maps and everything reachable through pointers is copied. Pointers already
+// copied during the same clone are looked up in a table, so shared and cyclic
+// structures keep their shape.
+
+static void cloneValue(ReflCache *cache, PtrMap *copies, Type *type,
+                       char *src, char *dst);
+
+static void *clonePointee(ReflCache *cache, PtrMap *copies, Type *type,
+                          void *ptr) {
+  if (ptr == NULL)
+    return NULL;
+
+  void *copy = ptrMapGet(copies, ptr);
+  if (copy)
+    return share(cache, copy);
+
+  // Nothing is known about what a ^void points to, so it is shared
+  int64_t size = getTypeInfo(cache, type)->size;
+  if (type->kind == TYPE_VOID || size <= 0)
+    return share(cache, ptr);
+
+  copy = cache->api->umkaAllocData(cache->umka, size, NULL);
+  ptrMapPut(copies, ptr, copy);
+  cloneValue(cache, copies, type, ptr, copy);
+  return copy;
+}
+
+static void cloneInterface(ReflCache *cache, PtrMap *copies, Interface *src,
+                           Interface *dst) {
+  if (src->selfType == NULL)
+    return;
+
+  if (src->selfType->kind == TYPE_PTR) {
+    dst->self = clonePointee(cache, copies, src->selfType->base, src->self);
+    return;
+  }
+
+  int64_t size = getTypeInfo(cache, src->selfType)->size;
+  dst->self = cache->api->umkaAllocData(cache->umka, size, NULL);
+  ptrMapPut(copies, src->self, dst->self);
+  cloneValue(cache, copies, src->selfType, src->self, dst->self);
+}
+
+static MapNode *cloneMapNode(ReflCache *cache, PtrMap *copies, Type *type,
+                             MapNode *src) {
+  if (src == NULL)
+    return NULL;
+
+  int64_t nodeSize = getTypeInfo(cache, type->base)->size;
+  MapNode *dst = cache->api->umkaAllocData(cache->umka, nodeSize, NULL);
+  memset(dst, 0, nodeSize);
+  dst->len = src->len;
+
+  if (src->key) {
+    Type *keyType = mapKeyType(type);
+    Type *itemType = mapItemType(type);
+
+    dst->key = cache->api->umkaAllocData(
+        cache->umka, getTypeInfo(cache, keyType)->size, NULL);
+    dst->data = cache->api->umkaAllocData(
+        cache->umka, getTypeInfo(cache, itemType)->size, NULL);
+
+    cloneValue(cache, copies, keyType, src->key, dst->key);
+    cloneValue(cache, copies, itemType, src->data, dst->data);
+  }
+
+  dst->left = cloneMapNode(cache, copies, type, src->left);
+  dst->right = cloneMapNode(cache, copies, type, src->right);
+  return dst;
+}
+
+static void cloneValue(ReflCache *cache, PtrMap *copies, Type *type,
+                       char *src, char *dst) {
+  ValuePlan *plan = getPlan(cache, type);
+  memcpy(dst, src, getTypeInfo(cache, type)->size);
+
+  if (plan->isPod)
+    return;
+
+  for (int i = 0; i < plan->numOps; i++) {
+    PlanOp *op = &plan->ops[i];
+    char *from = src + op->offset;
+    char *to = dst + op->offset;
+
+    switch (op->kind) {
+    case OP_STR:
+    case OP_FIBER:
+      share(cache, *(void **)from);
+      break;
+    case OP_PTR:
+      *(void **)to =
+          clonePointee(cache, copies, op->type->base, *(void **)from);
+      break;
+    case OP_DYNARRAY: {
+      DynArray *srcArray = (DynArray *)from;
+      DynArray *dstArray = (DynArray *)to;
+      int64_t len = dynArrayLen(srcArray);
+
+      if (srcArray->data == NULL)
+        break;
+
+      cache->api->umkaMakeDynArray(cache->umka, dstArray, op->type, len);
+
+      if (getPlan(cache, op->type->base)->isPod) {
+        memcpy(dstArray->data, srcArray->data, len * srcArray->itemSize);
+        break;
+      }
+
+      for (int64_t j = 0; j < len; j++)
+        cloneValue(cache, copies, op->type->base,
+                   (char *)srcArray->data + j * srcArray->itemSize,
+                   (char *)dstArray->data + j * dstArray->itemSize);
+      break;
+    }
+    case OP_MAP:
+      ((Map *)to)->root =
+          cloneMapNode(cache, copies, op->type, ((Map *)from)->root);
+      break;
+    case OP_ARRAY: {
+      int64_t itemSize = getTypeInfo(cache, op->type->base)->size;
+      for (int j = 0; j < op->type->numItems; j++)
+        cloneValue(cache, copies, op->type->base, from + j * itemSize,
+                   to + j * itemSize);
+      break;
+    }
+    case OP_INTERFACE:
+      cloneInterface(cache, copies, (Interface *)from, (Interface *)to);
+      break;
+    case OP_CLOSURE:
+      cloneInterface(cache, copies, &((Closure *)from)->upvalue,
+                     &((Closure *)to)->upvalue);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+FN(reflClone, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+
+  PtrMap copies = {0};
+  Interface result = *value;
+  cloneInterface(cache, &copies, value, &result);
+  freePtrMap(&copies);
+
+  *(Interface *)RET()->ptrVal = result;
+})
+
+// Type graph snapshots --
+//
+// Every type reachable from a set of roots is written into a flat file that
+// holds no pointers: types, members (struct fields, interface methods and
+// function parameters) and enum constants refer to each other and to a
+// string pool by index. The file is mapped read-only on load and queried in
+// place, without any compiler structures.
+
+enum { GRAPH_VERSION = 1 };
+
+static const char graphMagic[8] = "UMKREFL";
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t numTypes, numMembers, numConsts;
+  uint64_t stringsSize;
+} GraphHeader;
+
+enum { GRAPH_METHOD = 1, GRAPH_UPVALUES = 2 };
+
+typedef struct {
+  int32_t kind;     // Umka type kind
+  int32_t reflKind; // refl::TypeKind
+  int32_t name, file, line;
+  int32_t flags;
+  int64_t size, alignment;
+  int32_t base, key, result; // Type indices, or -1
+  int32_t length;            // For arrays
+  int32_t firstMember, numMembers;
+  int32_t firstConst, numConsts;
+} GraphType;
+
+typedef struct {
+  int32_t name, type;
+  int64_t offset;
+} GraphMember;
+
+typedef struct {
+  int32_t name, pad;
+  int64_t value;
+} GraphConst;
+
+typedef struct {
+  ReflBuf data;
+  int64_t *slots; // Offset + 1 of the strings already in the pool
+  int64_t numSlots, count;
+} StrPool;
+
+static int32_t poolAdd(StrPool *pool, const char *str) {
+  if (pool->count * 2 >= pool->numSlots) {
+    free(pool->slots);
+    pool->numSlots = pool->numSlots ? pool->numSlots * 2 : 256;
+    pool->slots = calloc(pool->numSlots, sizeof(int64_t));
+    pool->count = 0;
+
+    // Rehash by walking the pool itself
+    for (int64_t offset = 0; offset < pool->data.len;) {
+      const char *s = pool->data.data + offset;
+      uint64_t j = hashStr(s) & (pool->numSlots - 1);
+      while (pool->slots[j])
+        j = (j + 1) & (pool->numSlots - 1);
+      pool->slots[j] = offset + 1;
+      pool->count++;
+      offset += strlen(s) + 1;
+    }
+  }
+
+  uint64_t mask = pool->numSlots - 1;
+  uint64_t j = hashStr(str) & mask;
+  for (; pool->slots[j]; j = (j + 1) & mask) {
+    if (strcmp(pool->data.data + pool->slots[j] - 1, str) == 0)
+      return pool->slots[j] - 1;
+  }
+
+  int64_t offset = pool->data.len;
+  bufWrite(&pool->data, str, strlen(str) + 1);
+  pool->slots[j] = offset + 1;
+  pool->count++;
+  return offset;
+}
+
+typedef struct {
+  Type **types;
+  int64_t len, cap;
+  PtrMap indices; // Type index + 1
+} GraphTypes;
+
+static int32_t graphTypeIndex(GraphTypes *g, Type *type) {
+  if (type == NULL)
+    return -1;
+
+  intptr_t index = (intptr_t)ptrMapGet(&g->indices, type);
+  if (index)
+    return index - 1;
+
+  if (g->len == g->cap) {
+    g->cap = g->cap ? g->cap * 2 : 64;
+    g->types = realloc(g->types, g->cap * sizeof(Type *));
+  }
+
+  g->types[g->len++] = type;
+  ptrMapPut(&g->indices, type, (void *)(intptr_t)g->len);
+  return g->len - 1;
+}
+
+static void addGraphMember(ReflBuf *members, StrPool *pool, GraphTypes *g,
+                           const char *name, Type *type, int64_t offset) {
+  GraphMember member = {poolAdd(pool, name), graphTypeIndex(g, type), offset};
+  bufWrite(members, &member, sizeof(member));
+}
+
+static bool writeSection(FILE *file, const ReflBuf *section) {
+  return section->len == 0 ||
+         fwrite(section->data, 1, section->len, file) == (size_t)section->len;
+}
+
+static bool exportTypeGraph(ReflCache *cache, const char *path, Type **roots,
+                            int64_t numRoots) {
+  GraphTypes g = {0};
+  StrPool pool = {0};
+  ReflBuf types = {0}, members = {0}, consts = {0};
+
+  for (int64_t i = 0; i < numRoots; i++)
+    graphTypeIndex(&g, roots[i]);
+
+  // Types referenced while writing get appended and are written in turn
+  for (int64_t i = 0; i < g.len; i++) {
+    Type *type = g.types[i];
+    TypeInfo *info = getTypeInfo(cache, type);
+    GraphType rec = {0};
+
+    rec.kind = type->kind;
+    rec.reflKind = info->kind;
+    rec.name = poolAdd(&pool, typeName(type));
+    rec.file = poolAdd(&pool, type->typeIdent ? type->typeIdent->debug.fileName
+                                              : "?");
+    rec.line = type->typeIdent ? type->typeIdent->debug.line : 0;
+    rec.size = info->size;
+    rec.alignment = info->alignment;
+    rec.base = rec.key = rec.result = -1;
+    rec.firstMember = members.len / sizeof(GraphMember);
+    rec.firstConst = consts.len / sizeof(GraphConst);
+
+    if (type->isEnum) {
+      for (int j = 0; j < type->numItems; j++) {
+        GraphConst c = {poolAdd(&pool, type->enumConst[j]->name), 0,
+                        type->enumConst[j]->val.intVal};
+        bufWrite(&consts, &c, sizeof(c));
+      }
+      rec.numConsts = type->numItems;
+    } else if (type->kind == TYPE_STRUCT || type->kind == TYPE_INTERFACE) {
+      // Interfaces start with their self and selfType fields
+      int first = type->kind == TYPE_INTERFACE ? 2 : 0;
+      for (int j = first; j < type->numItems; j++)
+        addGraphMember(&members, &pool, &g, type->field[j]->name,
+                       type->field[j]->type, type->field[j]->offset);
+      rec.numMembers = type->numItems - first;
+    } else if (type->kind == TYPE_FN || type->kind == TYPE_CLOSURE) {
+      Signature *sig = type->kind == TYPE_CLOSURE
+                           ? &type->field[0]->type->sig
+                           : &type->sig;
+      int first = type->kind == TYPE_CLOSURE;
+      for (int j = first; j < sig->numParams; j++)
+        addGraphMember(&members, &pool, &g, sig->param[j]->name,
+                       sig->param[j]->type, 0);
+      rec.numMembers = sig->numParams - first;
+      rec.result = graphTypeIndex(&g, sig->resultType);
+      rec.flags = (sig->isMethod ? GRAPH_METHOD : 0) |
+                  (type->kind == TYPE_CLOSURE ? GRAPH_UPVALUES : 0);
+    } else if (type->kind == TYPE_MAP) {
+      rec.key = graphTypeIndex(&g, mapKeyType(type));
+      rec.base = graphTypeIndex(&g, mapItemType(type));
+    } else if (type->kind == TYPE_PTR || type->kind == TYPE_WEAKPTR ||
+               type->kind == TYPE_ARRAY || type->kind == TYPE_DYNARRAY) {
+      rec.base = graphTypeIndex(&g, type->base);
+      rec.length = type->kind == TYPE_ARRAY ? type->numItems : 0;
+    }
+
+    bufWrite(&types, &rec, sizeof(rec));
+  }
+
+  GraphHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, graphMagic, sizeof(header.magic));
+  header.version = GRAPH_VERSION;
+  header.numTypes = g.len;
+  header.numMembers = members.len / sizeof(GraphMember);
+  header.numConsts = consts.len / sizeof(GraphConst);
+  header.stringsSize = pool.data.len;
+
+  FILE *file = fopen(path, "wb");
+  bool ok = file != NULL;
+  if (ok) {
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         writeSection(file, &types) && writeSection(file, &members) &&
+         writeSection(file, &consts) && writeSection(file, &pool.data);
+    ok = fclose(file) == 0 && ok;
+  }
+
+  free(g.types);
+  freePtrMap(&g.indices);
+  free(pool.data.data);
+  free(pool.slots);
+  free(types.data);
+  free(members.data);
+  free(consts.data);
+  return ok;
+}
+
+FN(reflExportTypeGraph, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  const char *path = ARG(1)->ptrVal;
+  DynArray *roots = (DynArray *)ARG(2);
+
+  RET()->intVal =
+      exportTypeGraph(cache, path, roots->data, dynArrayLen(roots));
+})
+
+typedef struct {
+  const char *name;
+  int64_t type, offset;
+} GraphField;
+
+typedef UmkaDynArray(GraphField) GraphFieldArray;
+typedef UmkaDynArray(EnumVariant) GraphVariantArray;
+
+typedef struct {
+  const char *data;
+  int64_t size;
+  const GraphHeader *header;
+  const GraphType *types;
+  const GraphMember *members;
+  const GraphConst *consts;
+  const char *strings;
+  // Umka strings and dynarrays handed out for each type, built on first use
+  // and shared afterwards, like the ones of a TypeInfo
+  void *umka;
+  UmkaAPI *api;
+  char **names, **files;
+  GraphFieldArray *fields;
+  GraphVariantArray *variants;
+#ifdef _WIN32
+  HANDLE file, mapping;
+#endif
+} TypeGraph;
+
+static bool mapFile(TypeGraph *graph, const char *path) {
+#ifdef _WIN32
+  graph->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (graph->file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(graph->file, &size) || size.QuadPart == 0)
+    return false;
+
+  graph->mapping =
+      CreateFileMappingA(graph->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (graph->mapping == NULL)
+    return false;
+
+  graph->data = MapViewOfFile(graph->mapping, FILE_MAP_READ, 0, 0, 0);
+  graph->size = size.QuadPart;
+  return graph->data != NULL;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  graph->data = data;
+  graph->size = st.st_size;
+  return true;
+#endif
+}
+
+static void unmapFile(TypeGraph *graph) {
+#ifdef _WIN32
+  if (graph->data)
+    UnmapViewOfFile(graph->data);
+  if (graph->mapping)
+    CloseHandle(graph->mapping);
+  if (graph->file && graph->file != INVALID_HANDLE_VALUE)
+    CloseHandle(graph->file);
+  graph->mapping = graph->file = NULL;
+#else
+  if (graph->data)
+    munmap((void *)graph->data, graph->size);
+#endif
+  graph->data = NULL;
+}
+
+static bool graphIndexValid(const TypeGraph *graph, int32_t index) {
+  return index == -1 ||
+         (index >= 0 && (uint32_t)index < graph->header->numTypes);
+}
+
+// Everything is checked once on load, so that queries can trust the file
+static bool validateTypeGraph(TypeGraph *graph) {
+  const GraphHeader *h = (const GraphHeader *)graph->data;
+  if (graph->size < (int64_t)sizeof(GraphHeader) ||
+      memcmp(h->magic, graphMagic, sizeof(h->magic)) != 0 ||
+      h->version != GRAPH_VERSION)
+    return false;
+
+  uint64_t size = sizeof(GraphHeader) +
+                  (uint64_t)h->numTypes * sizeof(GraphType) +
+                  (uint64_t)h->numMembers * sizeof(GraphMember) +
+                  (uint64_t)h->numConsts * sizeof(GraphConst) + h->stringsSize;
+  if (size != (uint64_t)graph->size || h->stringsSize == 0)
+    return false;
+
+  graph->header = h;
+  graph->types = (const GraphType *)(h + 1);
+  graph->members = (const GraphMember *)(graph->types + h->numTypes);
+  graph->consts = (const GraphConst *)(graph->members + h->numMembers);
+  graph->strings = (const char *)(graph->consts + h->numConsts);
+
+  if (graph->strings[h->stringsSize - 1] != 0)
+    return false;
+
+#define CHECK_STR(s) ((s) >= 0 && (uint64_t)(s) < h->stringsSize)
+  for (uint32_t i = 0; i < h->numTypes; i++) {
+    const GraphType *t = &graph->types[i];
+    if (!CHECK_STR(t->name) || !CHECK_STR(t->file) ||
+        !graphIndexValid(graph, t->base) || !graphIndexValid(graph, t->key) ||
+        !graphIndexValid(graph, t->result) || t->firstMember < 0 ||
+        t->numMembers < 0 ||
+        (uint64_t)t->firstMember + t->numMembers > h->numMembers ||
+        t->firstConst < 0 || t->numConsts < 0 ||
+        (uint64_t)t->firstConst + t->numConsts > h->numConsts)
+      return false;
+  }
+
+  for (uint32_t i = 0; i < h->numMembers; i++) {
+    if (!CHECK_STR(graph->members[i].name) ||
+        !graphIndexValid(graph, graph->members[i].type))
+      return false;
+  }
+
+  for (uint32_t i = 0; i < h->numConsts; i++) {
+    if (!CHECK_STR(graph->consts[i].name))
+      return false;
+  }
+#undef CHECK_STR
+
+  return true;
+}
+
+static void releaseGraphData(TypeGraph *graph, void *ptr) {
+  if (ptr)
+    graph->api->umkaDecRef(graph->umka, ptr);
+}
+
+// Called by Umka with the chunk's data pointer in the first slot
+static void freeTypeGraph(UmkaStackSlot *p, UmkaStackSlot *r) {
+  (void)r;
+  TypeGraph *graph = p[0].ptrVal;
+
+  for (uint32_t i = 0; graph->names && i < graph->header->numTypes; i++) {
+    releaseGraphData(graph, graph->names[i]);
+    releaseGraphData(graph, graph->files[i]);
+    releaseGraphData(graph, graph->fields[i].data);
+    releaseGraphData(graph, graph->variants[i].data);
+  }
+
+  free(graph->names);
+  free(graph->files);
+  free(graph->fields);
+  free(graph->variants);
+  unmapFile(graph);
+}
+
+FN(reflLoadTypeGraph, {
+  const char *path = ARG(0)->ptrVal;
+
+  TypeGraph *graph =
+      api->umkaAllocData(umka, sizeof(TypeGraph), freeTypeGraph);
+  memset(graph, 0, sizeof(TypeGraph));
+  graph->umka = umka;
+  graph->api = api;
+
+  if (!mapFile(graph, path) || !validateTypeGraph(graph)) {
+    unmapFile(graph);
+    api->umkaDecRef(umka, graph);
+    RET()->ptrVal = NULL;
+    return;
+  }
+
+  uint32_t numTypes = graph->header->numTypes;
+  graph->names = calloc(numTypes, sizeof(char *));
+  graph->files = calloc(numTypes, sizeof(char *));
+  graph->fields = calloc(numTypes, sizeof(*graph->fields));
+  graph->variants = calloc(numTypes, sizeof(*graph->variants));
+
+  RET()->ptrVal = graph;
+})
+
+// Returns the type record, or NULL if the index is out of range
+static const GraphType *graphType(TypeGraph *graph, int64_t index) {
+  if (graph == NULL || index < 0 || index >= graph->header->numTypes)
+    return NULL;
+  return &graph->types[index];
+}
+
+FN(reflGraphCount, {
+  TypeGraph *graph = ARG(0)->ptrVal;
+
+  RET()->intVal = graph ? graph->header->numTypes : 0;
+})
+
+FN(reflGraphFind, {
+  TypeGraph *graph = ARG(0)->ptrVal;
+  const char *name = ARG(1)->ptrVal;
+
+  RET()->intVal = -1;
+  for (uint32_t i = 0; graph && i < graph->header->numTypes; i++) {
+    if (strcmp(graph->strings + graph->types[i].name, name) == 0) {
+      RET()->intVal = i;
+      return;
+    }
+  }
+})
+
+FN(reflGraphKind, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->intVal = t ? t->reflKind : RTK_INVALID;
+})
+
+// Hands out another reference to the string kept in *slot, making it first
+static char *graphString(TypeGraph *graph, char **slot, const char *str) {
+  if (*slot == NULL)
+    *slot = graph->api->umkaMakeStr(graph->umka, str);
+  graph->api->umkaIncRef(graph->umka, *slot);
+  return *slot;
+}
+
+FN(reflGraphName, {
+  TypeGraph *graph = ARG(0)->ptrVal;
+  const GraphType *t = graphType(graph, ARG(1)->intVal);
+
+  if (t == NULL) {
+    RET()->ptrVal = api->umkaMakeStr(umka, "invalid");
+    return;
+  }
+
+  RET()->ptrVal = graphString(graph, &graph->names[t - graph->types],
+                              graph->strings + t->name);
+})
+
+FN(reflGraphLocation, {
+  TypeGraph *graph = ARG(0)->ptrVal;
+  const GraphType *t = graphType(graph, ARG(1)->intVal);
+
+  struct Location loc;
+  if (t) {
+    loc.file = graphString(graph, &graph->files[t - graph->types],
+                           graph->strings + t->file);
+  } else {
+    loc.file = api->umkaMakeStr(umka, "?");
+  }
+  loc.line = t ? t->line : 0;
+
+  *(struct Location *)RET()->ptrVal = loc;
+})
+
+FN(reflGraphSize, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->uintVal = t ? t->size : 0;
+})
+
+FN(reflGraphAlignment, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->uintVal = t ? t->alignment : 0;
+})
+
+FN(reflGraphUnderlying, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->intVal = t ? t->base : -1;
+})
+
+FN(reflGraphKey, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->intVal = t ? t->key : -1;
+})
+
+FN(reflGraphReturnType, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->intVal = t ? t->result : -1;
+})
+
+FN(reflGraphLength, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->uintVal = t ? t->length : 0;
+})
+
+FN(reflGraphIsMethod, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->intVal = t && (t->flags & GRAPH_METHOD);
+})
+
+FN(reflGraphHasUpvalues, {
+  const GraphType *t = graphType(ARG(0)->ptrVal, ARG(1)->intVal);
+
+  RET()->intVal = t && (t->flags & GRAPH_UPVALUES);
+})
+
+FN(reflGraphFields, {
+  TypeGraph *graph = ARG(0)->ptrVal;
+  const GraphType *t = graphType(graph, ARG(1)->intVal);
+  Type *graphfieldtype = ARG(2)->ptrVal;
+
+  GraphFieldArray *result = RET()->ptrVal;
+  if (t == NULL) {
+    api->umkaMakeDynArray(umka, result, graphfieldtype, 0);
+    return;
+  }
+
+  GraphFieldArray *fields = &graph->fields[t - graph->types];
+  if (fields->data == NULL) {
+    api->umkaMakeDynArray(umka, fields, graphfieldtype, t->numMembers);
+
+    for (int32_t i = 0; i < t->numMembers; i++) {
+      const GraphMember *m = &graph->members[t->firstMember + i];
+      fields->data[i].name = api->umkaMakeStr(umka, graph->strings + m->name);
+      fields->data[i].type = m->type;
+      fields->data[i].offset = m->offset;
+    }
+  }
+
+  api->umkaIncRef(umka, fields->data);
+  *result = *fields;
+})
+
+FN(reflGraphVariants, {
+  TypeGraph *graph = ARG(0)->ptrVal;
+  const GraphType *t = graphType(graph, ARG(1)->intVal);
+  Type *enumvarianttype = ARG(2)->ptrVal;
+
+  GraphVariantArray *result = RET()->ptrVal;
+  if (t == NULL) {
+    api->umkaMakeDynArray(umka, result, enumvarianttype, 0);
+    return;
+  }
+
+  GraphVariantArray *variants = &graph->variants[t - graph->types];
+  if (variants->data == NULL) {
+    api->umkaMakeDynArray(umka, variants, enumvarianttype, t->numConsts);
+
+    for (int32_t i = 0; i < t->numConsts; i++) {
+      const GraphConst *c = &graph->consts[t->firstConst + i];
+      variants->data[i].name = api->umkaMakeStr(umka, graph->strings + c->name);
+      variants->data[i].value = c->value;
+    }
+  }
+
+  api->umkaIncRef(umka, variants->data);
+  *result = *variants;
+})
+
+// Type hashing --
+//
+// A structural hash consistent with typeEquivalent: named types hash by their
+// identifier, anything else by its kind and whatever it is built from. A type
+// met again while it is still being hashed contributes its distance up the
+// stack instead, so cycles terminate and hash the same way from the same root.
+
+typedef struct HashedType {
+  Type *type;
+  struct HashedType *next;
+} HashedType;
+
+static uint64_t typeHashRecursive(ReflCache *cache, Type *type,
+                                  HashedType *stack, bool *cyclic);
+
+static uint64_t signatureHash(ReflCache *cache, Signature *sig,
+                              HashedType *stack, bool *cyclic, uint64_t h) {
+  h = hashInt(sig->numParams, h);
+  h = hashInt(sig->numDefaultParams, h);
+  h = hashInt(sig->isMethod, h);
+
+  for (int i = 0; i < sig->numParams; i++) {
+    Type *param = sig->param[i]->type;
+    h = hashInt(typeHashRecursive(cache, param, stack, cyclic), h);
+  }
+
+  return hashInt(typeHashRecursive(cache, sig->resultType, stack, cyclic), h);
+}
+
+static uint64_t typeHashRecursive(ReflCache *cache, Type *type,
+                                  HashedType *stack, bool *cyclic) {
+  if (type == NULL)
+    return hashInt(0, 0);
+  if (type->typeIdent)
+    return hashInt((uintptr_t)type->typeIdent, 1);
+
+  TypeInfo *info = getTypeInfo(cache, type);
+  if (info->hashed)
+    return info->typeHash;
+
+  int depth = 0;
+  for (HashedType *entry = stack; entry; entry = entry->next, depth++) {
+    if (entry->type == type) {
+      *cyclic = true;
+      return hashInt(depth, 2);
+    }
+  }
+
+  HashedType self = {type, stack};
+  bool selfCyclic = false;
+  uint64_t h = hashInt(type->kind, 3);
+  h = hashInt(type->isEnum, h);
+
+  switch (type->kind) {
+  case TYPE_ARRAY:
+    h = hashInt(type->numItems, h);
+    h = hashInt(typeHashRecursive(cache, type->base, &self, &selfCyclic), h);
+    break;
+  case TYPE_PTR:
+  case TYPE_WEAKPTR:
+  case TYPE_DYNARRAY:
+  case TYPE_MAP:
+    h = hashInt(typeHashRecursive(cache, type->base, &self, &selfCyclic), h);
+    break;
+  case TYPE_STRUCT:
+  case TYPE_INTERFACE:
+  case TYPE_CLOSURE:
+    h = hashInt(type->numItems, h);
+    h = hashInt(type->isExprList, h);
+    for (int i = 0; i < type->numItems; i++) {
+      h = hashInt(type->field[i]->hash, h);
+      h = hashInt(typeHashRecursive(cache, type->field[i]->type, &self,
+                                    &selfCyclic),
+                  h);
+    }
+    break;
+  case TYPE_FN:
+    h = signatureHash(cache, &type->sig, &self, &selfCyclic, h);
+    break;
+  default:
+    break;
+  }
+
+  if (type->isEnum) {
+    for (int i = 0; i < type->numItems; i++) {
+      h = hashInt(type->enumConst[i]->hash, h);
+      h = hashInt(type->enumConst[i]->val.uintVal, h);
+    }
+  }
+
+  if (selfCyclic) {
+    *cyclic = true;
+  } else {
+    info->hashed = true;
+    info->typeHash = h;
+  }
+
+  return h;
+}
+
+static uint64_t typeHash(ReflCache *cache, Type *type) {
+  bool cyclic = false;
+  return typeHashRecursive(cache, type, NULL, &cyclic);
+}
+
+FN(reflTypeHash, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *type = ARG(1)->ptrVal;
+
+  RET()->uintVal = typeHash(cache, type);
+})
+
+// Comparing hashes first rules out most different types without walking them
+FN(reflSameType, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *left = ARG(1)->ptrVal;
+  Type *right = ARG(2)->ptrVal;
+
+  RET()->intVal = left == right ||
+                  (left && right &&
+                   typeHash(cache, left) == typeHash(cache, right) &&
+                   typeEquivalent(left, right));
+})
+
+// Conversions --
+//
+// Follows Umka's assignment rules for implicit conversions, and its cast
+// rules on top of those for explicit ones. Results are kept in the pair
+// cache, one relation for each.
+
+static bool isInteger(Type *type) {
+  return type->kind >= TYPE_INT8 && type->kind <= TYPE_UINT;
+}
+
+static bool isOrdinal(Type *type) {
+  return isInteger(type) || type->kind == TYPE_CHAR;
+}
+
+static bool isReal(Type *type) {
+  return type->kind == TYPE_REAL32 || type->kind == TYPE_REAL;
+}
+
+static bool isNullable(Type *type) {
+  return type->kind == TYPE_PTR || type->kind == TYPE_WEAKPTR ||
+         type->kind == TYPE_FN || type->kind == TYPE_CLOSURE ||
+         type->kind == TYPE_INTERFACE;
+}
+
+static bool isByteDynArray(Type *type) {
+  return type->kind == TYPE_DYNARRAY && type->base &&
+         (type->base->kind == TYPE_CHAR || type->base->kind == TYPE_UINT8);
+}
+
+// Named types can be cast to and from anything with the same structure
+static bool sameExceptIdent(Type *left, Type *right) {
+  Type leftCopy = *left;
+  Type rightCopy = *right;
+  leftCopy.typeIdent = rightCopy.typeIdent = NULL;
+  return typeEquivalent(&leftCopy, &rightCopy);
+}
+
+static bool implicitlyConvertible(ReflCache *cache, Type *from, Type *to) {
+  if (typeEquivalent(from, to))
+    return true;
+
+  if (isInteger(from) && isInteger(to))
+    return !from->isEnum && !to->isEnum;
+  if ((isInteger(from) || isReal(from)) && isReal(to))
+    return !from->isEnum;
+  if (from->kind == TYPE_CHAR && to->kind == TYPE_STR)
+    return true;
+  if (from->kind == TYPE_NULL)
+    return isNullable(to);
+
+  switch (to->kind) {
+  case TYPE_PTR:
+    // Anything goes into ^void, weak pointers become strong again
+    return (from->kind == TYPE_PTR && to->base->kind == TYPE_VOID) ||
+           (from->kind == TYPE_WEAKPTR && typeEquivalent(from->base, to->base));
+  case TYPE_WEAKPTR:
+    return from->kind == TYPE_PTR && typeEquivalent(from->base, to->base);
+  case TYPE_DYNARRAY:
+    return from->kind == TYPE_ARRAY && typeEquivalent(from->base, to->base);
+  case TYPE_CLOSURE:
+    return from->kind == TYPE_FN &&
+           signatureEquivalent(&from->sig, &to->field[0]->type->sig, 0, NULL);
+  case TYPE_INTERFACE:
+    return implements(cache, from, to);
+  default:
+    return false;
+  }
+}
+
+static bool canConvert(ReflCache *cache, Type *from, Type *to, bool explicit);
+
+static bool explicitlyConvertible(ReflCache *cache, Type *from, Type *to) {
+  if (canConvert(cache, from, to, false))
+    return true;
+
+  if ((isOrdinal(from) || isReal(from)) && (isOrdinal(to) || isReal(to)))
+    return !(isReal(from) && isOrdinal(to));
+  if (from->kind == TYPE_PTR && to->kind == TYPE_PTR)
+    return true;
+  if (from->kind == TYPE_STR && isByteDynArray(to))
+    return true;
+  if (isByteDynArray(from) && to->kind == TYPE_STR)
+    return true;
+
+  return from->kind == to->kind && sameExceptIdent(from, to);
+}
+
+static bool canConvert(ReflCache *cache, Type *from, Type *to, bool explicit) {
+  if (from == NULL || to == NULL)
+    return false;
+  if (from == to)
+    return true;
+
+  enum PairRelation relation = explicit ? PAIR_EXPLICIT : PAIR_IMPLICIT;
+  PairEntry *entry = findPair(cache, from, to, relation);
+  if (entry->relation)
+    return entry->result;
+
+  bool result = explicit ? explicitlyConvertible(cache, from, to)
+                         : implicitlyConvertible(cache, from, to);
+
+  // The checks above may have added pairs and moved the table
+  entry = findPair(cache, from, to, relation);
+  rememberPair(cache, entry, from, to, relation, result);
+  return result;
+}
+
+FN(reflCanConvert, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Type *from = ARG(1)->ptrVal;
+  Type *to = ARG(2)->ptrVal;
+  bool explicit = ARG(3)->intVal;
+
+  RET()->intVal = canConvert(cache, from, to, explicit);
+})
+
+// Fills a row for every type in from, with a column for every type in to
+FN(reflConversionMatrix, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  UmkaDynArray(Type *) *from = (void *)ARG(1);
+  UmkaDynArray(Type *) *to = (void *)ARG(2);
+  bool explicit = ARG(3)->intVal;
+  Type *boolarraytype = ARG(4)->ptrVal;
+
+  UmkaDynArray(bool) *result = RET()->ptrVal;
+  int64_t rows = dynArrayLen((DynArray *)from);
+  int64_t cols = dynArrayLen((DynArray *)to);
+  api->umkaMakeDynArray(umka, result, boolarraytype, rows * cols);
+
+  for (int64_t i = 0; i < rows; i++) {
+    for (int64_t j = 0; j < cols; j++) {
+      result->data[i * cols + j] =
+          canConvert(cache, from->data[i], to->data[j], explicit);
+    }
+  }
+})
+
+// Migration --
+//
+// Moves records from an old version of a struct into a new one. Fields are
+// matched by name. A field of an equivalent type is copied, a number of a
+// different type is converted, and anything else starts out zeroed. The plan
+// is compiled once per pair of versions and then run for every record. A
+// real that doesn't fit the integer field it goes into fails the migration.
+
+enum MigrationOpKind {
+  MIGRATE_COPY,
+  MIGRATE_RETAIN, // Copied above, but holds references that need counting
+  MIGRATE_CONVERT,
+  MIGRATE_ZERO
+};
+
+typedef struct {
+  enum MigrationOpKind kind;
+  int64_t from, to, size;
+  Type *fromType, *toType;
+} MigrationOp;
+
+typedef struct MigrationPlan {
+  Type *from;
+  MigrationOp *ops;
+  int numOps, capOps;
+  struct MigrationPlan *next;
+} MigrationPlan;
+
+static void freeMigrations(MigrationPlan *plan) {
+  while (plan) {
+    MigrationPlan *next = plan->next;
+    free(plan->ops);
+    free(plan);
+    plan = next;
+  }
+}
+
+static void addMigrationOp(MigrationPlan *plan, MigrationOp op) {
+  // Fields that follow each other in both versions are copied together
+  MigrationOp *last = plan->numOps ? &plan->ops[plan->numOps - 1] : NULL;
+  if (op.kind == MIGRATE_COPY && last && last->kind == MIGRATE_COPY &&
+      last->from + last->size == op.from && last->to + last->size == op.to) {
+    last->size += op.size;
+    return;
+  }
+
+  if (plan->numOps == plan->capOps) {
+    plan->capOps = plan->capOps ? plan->capOps * 2 : 8;
+    plan->ops = realloc(plan->ops, plan->capOps * sizeof(MigrationOp));
+  }
+
+  plan->ops[plan->numOps++] = op;
+}
+
+static bool isNumber(Type *type) { return isOrdinal(type) || isReal(type); }
+
+static MigrationPlan *compileMigration(ReflCache *cache, Type *from,
+                                       Type *to) {
+  MigrationPlan *plan = calloc(1, sizeof(MigrationPlan));
+  plan->from = from;
+
+  // Retains go last, so that they don't split up the copies
+  MigrationOp *retains = calloc(to->numItems + 1, sizeof(MigrationOp));
+  int numRetains = 0;
+
+  for (int i = 0; i < to->numItems; i++) {
+    Field *field = to->field[i];
+    int j = findField(cache, from, field->name);
+    Field *old = j >= 0 ? from->field[j] : NULL;
+
+    MigrationOp op;
+    memset(&op, 0, sizeof(op));
+    op.kind = MIGRATE_ZERO;
+    op.to = field->offset;
+    op.size = getTypeInfo(cache, field->type)->size;
+    op.toType = field->type;
+
+    if (old && typeEquivalent(old->type, field->type)) {
+      op.kind = MIGRATE_COPY;
+      op.from = old->offset;
+      op.fromType = old->type;
+      if (!getPlan(cache, field->type)->isPod)
+        retains[numRetains++] = (MigrationOp){MIGRATE_RETAIN, old->offset,
+                                              field->offset, op.size,
+                                              old->type, field->type};
+    } else if (old && isNumber(old->type) && isNumber(field->type)) {
+      op.kind = MIGRATE_CONVERT;
+      op.from = old->offset;
+      op.fromType = old->type;
+    }
+
+    addMigrationOp(plan, op);
+  }
+
+  for (int i = 0; i < numRetains; i++)
+    addMigrationOp(plan, retains[i]);
+
+  free(retains);
+  return plan;
+}
+
+static MigrationPlan *getMigration(ReflCache *cache, Type *from, Type *to) {
+  TypeInfo *info = getTypeInfo(cache, to);
+
+  for (MigrationPlan *plan = info->migrations; plan; plan = plan->next) {
+    if (plan->from == from)
+      return plan;
+  }
+
+  MigrationPlan *plan = compileMigration(cache, from, to);
+  plan->next = info->migrations;
+  info->migrations = plan;
+  return plan;
+}
+
+// Whether a real truncates to a value the type can hold. Casting one that
+// doesn't, or a NaN, to an integer is undefined.
+static bool realFits(Type *type, double real) {
+  // Bounds are exclusive, the first doubles just out of range
+  double below, above;
+
+  switch (type->kind) {
+  case TYPE_INT8:
+    below = -129.0, above = 128.0;
+    break;
+  case TYPE_INT16:
+    below = -32769.0, above = 32768.0;
+    break;
+  case TYPE_INT32:
+    below = -2147483649.0, above = 2147483648.0;
+    break;
+  case TYPE_INT:
+    below = -9223372036854777856.0, above = 9223372036854775808.0;
+    break;
+  case TYPE_UINT8:
+  case TYPE_CHAR:
+    below = -1.0, above = 256.0;
+    break;
+  case TYPE_UINT16:
+    below = -1.0, above = 65536.0;
+    break;
+  case TYPE_UINT32:
+    below = -1.0, above = 4294967296.0;
+    break;
+  case TYPE_UINT:
+    below = -1.0, above = 18446744073709551616.0;
+    break;
+  default:
+    return true;
+  }
+
+  return real > below && real < above;
+}
+
+// Only reached for values that pass migrationFits
+static void convertNumber(Type *fromType, char *from, Type *toType, char *to) {
+  double real = 0;
+  int64_t integer = 0;
+
+  if (isReal(fromType)) {
+    real = readReal(fromType, from);
+    if (!isReal(toType))
+      integer = real < 0 ? (int64_t)real : (int64_t)(uint64_t)real;
+  } else if (fromType->kind == TYPE_CHAR) {
+    integer = *(uint8_t *)from;
+    real = integer;
+  } else if (fromType->kind == TYPE_UINT) {
+    integer = *(int64_t *)from;
+    real = *(uint64_t *)from;
+  } else {
+    integer = readInteger(fromType, from);
+    real = integer;
+  }
+
+  switch (toType->kind) {
+  case TYPE_INT8:
+  case TYPE_UINT8:
+  case TYPE_CHAR:
+    *(uint8_t *)to = integer;
+    break;
+  case TYPE_INT16:
+  case TYPE_UINT16:
+    *(uint16_t *)to = integer;
+    break;
+  case TYPE_INT32:
+  case TYPE_UINT32:
+    *(uint32_t *)to = integer;
+    break;
+  case TYPE_REAL32:
+    *(float *)to = real;
+    break;
+  case TYPE_REAL:
+    *(double *)to = real;
+    break;
+  default:
+    *(int64_t *)to = integer;
+    break;
+  }
+}
+
+// Checked for every record before any is migrated, so that a real which can't
+// be converted fails the whole migration rather than leave it half done
+static bool migrationFits(MigrationPlan *plan, char *from) {
+  for (int i = 0; i < plan->numOps; i++) {
+    MigrationOp *op = &plan->ops[i];
+    if (op->kind == MIGRATE_CONVERT && isReal(op->fromType) &&
+        !realFits(op->toType, readReal(op->fromType, from + op->from)))
+      return false;
+  }
+  return true;
+}
+
+static void runMigration(ReflCache *cache, MigrationPlan *plan, char *from,
+                         char *to) {
+  for (int i = 0; i < plan->numOps; i++) {
+    MigrationOp *op = &plan->ops[i];
+
+    switch (op->kind) {
+    case MIGRATE_COPY:
+      memcpy(to + op->to, from + op->from, op->size);
+      break;
+    case MIGRATE_RETAIN:
+      retainValue(cache, op->toType, to + op->to);
+      break;
+    case MIGRATE_CONVERT:
+      convertNumber(op->fromType, from + op->from, op->toType, to + op->to);
+      break;
+    case MIGRATE_ZERO:
+      memset(to + op->to, 0, op->size);
+      break;
+    }
+  }
+}
+
+// Migrates a struct into the struct dst points to, or a dynarray of structs
+// into a new dynarray stored where dst points. The old value at dst is moved
+// into the result, so it's still there to read from when src is the same.
+FN(reflMigrate, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *src = (Interface *)ARG(1);
+  Interface *dst = (Interface *)ARG(2);
+
+  Type *fromType = src->selfType;
+  Type *toType = dst->selfType ? dst->selfType->base : NULL;
+  ReplaceResult *result = RET()->ptrVal;
+  memset(result, 0, sizeof(*result));
+
+  if (fromType == NULL || toType == NULL || dst->self == NULL ||
+      dst->selfType->kind != TYPE_PTR || src->self == NULL)
+    return;
+
+  if (fromType->kind == TYPE_STRUCT && toType->kind == TYPE_STRUCT) {
+    MigrationPlan *plan = getMigration(cache, fromType, toType);
+    char *record = dst->self;
+    if (!migrationFits(plan, src->self))
+      return;
+
+    result->old = boxValue(cache, toType, record);
+    releaseValue(cache, toType, record);
+
+    char *from = src->self == record ? result->old.self : src->self;
+    runMigration(cache, plan, from, record);
+    result->ok = true;
+    return;
+  }
+
+  if (fromType->kind != TYPE_DYNARRAY || toType->kind != TYPE_DYNARRAY ||
+      fromType->base->kind != TYPE_STRUCT || toType->base->kind != TYPE_STRUCT)
+    return;
+
+  // Copied, as making the new dynarray overwrites it if src is dst
+  DynArray records = *(DynArray *)src->self;
+  DynArray *array = dst->self;
+  int64_t len = dynArrayLen(&records);
+  MigrationPlan *plan = getMigration(cache, fromType->base, toType->base);
+
+  for (int64_t i = 0; i < len; i++) {
+    if (!migrationFits(plan, (char *)records.data + i * records.itemSize))
+      return;
+  }
+
+  // The old items stay alive in the result until after they've been read
+  result->old = boxValue(cache, toType, (char *)array);
+  release(cache, array->data);
+  api->umkaMakeDynArray(umka, array, toType, len);
+
+  char *from = records.data;
+  char *to = array->data;
+  for (int64_t i = 0; i < len; i++) {
+    runMigration(cache, plan, from, to);
+    from += records.itemSize;
+    to += array->itemSize;
+  }
+
+  result->ok = true;
+})
+
+// Struct of arrays --
+//
+// Splits a dynarray of structs into one column per field of plain data, and
+// writes such columns back. Fields of 4 and 8 bytes, which is most of them,
+// are moved by loops of fixed width that compilers can unroll and vectorize.
+
+typedef struct {
+  const char *name;
+  int64_t field, size;
+  UmkaDynArray(uint8_t) data;
+} SoAColumn;
+
+static void gather(char *column, const char *records, int64_t stride,
+                   int64_t size, int64_t len) {
+  if (size == 4) {
+    uint32_t *out = (uint32_t *)column;
+    for (int64_t i = 0; i < len; i++)
+      memcpy(&out[i], records + i * stride, 4);
+  } else if (size == 8) {
+    uint64_t *out = (uint64_t *)column;
+    for (int64_t i = 0; i < len; i++)
+      memcpy(&out[i], records + i * stride, 8);
+  } else {
+    for (int64_t i = 0; i < len; i++)
+      memcpy(column + i * size, records + i * stride, size);
+  }
+}
+
+static void scatter(char *records, const char *column, int64_t stride,
+                    int64_t size, int64_t len) {
+  if (size == 4) {
+    const uint32_t *in = (const uint32_t *)column;
+    for (int64_t i = 0; i < len; i++)
+      memcpy(records + i * stride, &in[i], 4);
+  } else if (size == 8) {
+    const uint64_t *in = (const uint64_t *)column;
+    for (int64_t i = 0; i < len; i++)
+      memcpy(records + i * stride, &in[i], 8);
+  } else {
+    for (int64_t i = 0; i < len; i++)
+      memcpy(records + i * stride, column + i * size, size);
+  }
+}
+
+// Resolves the struct type of the dynarray held in an any
+static Type *unwrapRecords(Interface *value, DynArray **records) {
+  Type *type = value->selfType;
+  *records = value->self;
+
+  if (type && type->kind == TYPE_PTR)
+    type = type->base;
+
+  if (type == NULL || type->kind != TYPE_DYNARRAY || *records == NULL ||
+      type->base->kind != TYPE_STRUCT)
+    return NULL;
+
+  return type->base;
+}
+
+FN(reflToSoA, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+  Type *columnstype = ARG(2)->ptrVal;
+  Type *bytestype = ARG(3)->ptrVal;
+
+  UmkaDynArray(SoAColumn) *result = RET()->ptrVal;
+  DynArray *records;
+  Type *type = unwrapRecords(value, &records);
+
+  int numColumns = 0;
+  for (int i = 0; type && i < type->numItems; i++) {
+    if (getPlan(cache, type->field[i]->type)->isPod)
+      numColumns++;
+  }
+
+  api->umkaMakeDynArray(umka, result, columnstype, numColumns);
+  if (numColumns == 0)
+    return;
+
+  int64_t len = dynArrayLen(records);
+  SoAColumn *column = result->data;
+
+  for (int i = 0; i < type->numItems; i++) {
+    Field *field = type->field[i];
+    if (!getPlan(cache, field->type)->isPod)
+      continue;
+
+    column->name = share(cache, intern(cache, field->name));
+    column->field = i;
+    column->size = getTypeInfo(cache, field->type)->size;
+    api->umkaMakeDynArray(umka, &column->data, bytestype, len * column->size);
+
+    gather((char *)column->data.data, (char *)records->data + field->offset,
+           records->itemSize, column->size, len);
+    column++;
+  }
+})
+
+// All columns are checked before anything is written
+FN(reflFromSoA, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  DynArray *columns = (DynArray *)ARG(1);
+  Interface *value = (Interface *)ARG(2);
+
+  DynArray *records;
+  Type *type = unwrapRecords(value, &records);
+  RET()->intVal = false;
+  if (type == NULL)
+    return;
+
+  int64_t len = dynArrayLen(records);
+  int64_t numColumns = dynArrayLen(columns);
+  SoAColumn *column = columns->data;
+
+  for (int64_t i = 0; i < numColumns; i++) {
+    int64_t field = column[i].field;
+    if (field < 0 || field >= type->numItems)
+      return;
+
+    Type *fieldType = type->field[field]->type;
+    if (!getPlan(cache, fieldType)->isPod ||
+        column[i].size != getTypeInfo(cache, fieldType)->size ||
+        dynArrayDataLen(column[i].data.data) != len * column[i].size)
+      return;
+  }
+
+  for (int64_t i = 0; i < numColumns; i++) {
+    Field *field = type->field[column[i].field];
+    scatter((char *)records->data + field->offset, (char *)column[i].data.data,
+            records->itemSize, column[i].size, len);
+  }
+
+  RET()->intVal = true;
+})
+
+// Scanning --
+//
+// Finds the records of a dynarray of structs whose field compares true
+// against a constant. The field is resolved once, then read at a fixed
+// stride by a loop specialized for its type and the comparison. The loops
+// have no branches in them, a record's index is written either way and only
+// kept if it matched, so that compilers can vectorize them.
+
+enum ScanOp { SCAN_EQ, SCAN_NE, SCAN_LT, SCAN_LE, SCAN_GT, SCAN_GE };
+
+// Follows a path such as "pos.x" or "deck[2].count" through nested structs
+// and fixed arrays. Returns NULL if it does not lead anywhere.
+static Type *resolveFieldPath(ReflCache *cache, Type *type, const char *path,
+                              int64_t *offset) {
+  char name[MAX_IDENT_LEN + 1];
+  *offset = 0;
+
+  while (*path) {
+    if (*path == '[') {
+      char *end;
+      int64_t index = strtoll(path + 1, &end, 10);
+      if (type->kind != TYPE_ARRAY || *end != ']' || index < 0 ||
+          index >= type->numItems)
+        return NULL;
+
+      *offset += index * getTypeInfo(cache, type->base)->size;
+      type = type->base;
+      path = end + 1;
+      continue;
+    }
+
+    if (*path == '.')
+      path++;
+
+    size_t len = strcspn(path, ".[");
+    if (type->kind != TYPE_STRUCT || len == 0 || len > MAX_IDENT_LEN)
+      return NULL;
+
+    memcpy(name, path, len);
+    name[len] = 0;
+
+    int i = findField(cache, type, name);
+    if (i < 0)
+      return NULL;
+
+    *offset += type->field[i]->offset;
+    type = type->field[i]->type;
+    path += len;
+  }
+
+  return type;
+}
+
+#define SCAN_LOOP(ctype, valuetype, cmp, constant)                             \
+  for (int64_t i = 0; i < len; i++) {                                          \
+    valuetype x = *(const ctype *)(data + i * stride);                         \
+    out[n] = i;                                                                \
+    n += x cmp constant;                                                       \
+  }
+
+#define SCAN(ctype, valuetype, constant)                                       \
+  switch (op) {                                                                \
+  case SCAN_EQ:                                                                \
+    SCAN_LOOP(ctype, valuetype, ==, constant) break;                           \
+  case SCAN_NE:                                                                \
+    SCAN_LOOP(ctype, valuetype, !=, constant) break;                           \
+  case SCAN_LT:                                                                \
+    SCAN_LOOP(ctype, valuetype, <, constant) break;                            \
+  case SCAN_LE:                                                                \
+    SCAN_LOOP(ctype, valuetype, <=, constant) break;                           \
+  case SCAN_GT:                                                                \
+    SCAN_LOOP(ctype, valuetype, >, constant) break;                            \
+  case SCAN_GE:                                                                \
+    SCAN_LOOP(ctype, valuetype, >=, constant) break;                           \
+  }
+
+static int64_t readOrdinal(Type *type, char *data) {
+  if (type->kind == TYPE_BOOL || type->kind == TYPE_CHAR)
+    return *(uint8_t *)data;
+  return readInteger(type, data);
+}
+
+static bool scanMatches(double x, enum ScanOp op, double constant) {
+  switch (op) {
+  case SCAN_EQ:
+    return x == constant;
+  case SCAN_NE:
+    return x != constant;
+  case SCAN_LT:
+    return x < constant;
+  case SCAN_LE:
+    return x <= constant;
+  case SCAN_GT:
+    return x > constant;
+  default:
+    return x >= constant;
+  }
+}
+
+static int64_t scanIntegers(Type *type, const char *data, int64_t stride,
+                            int64_t len, enum ScanOp op, int64_t constant,
+                            int64_t *out) {
+  int64_t n = 0;
+
+  switch (type->kind) {
+  case TYPE_INT8:
+    SCAN(int8_t, int64_t, constant) break;
+  case TYPE_INT16:
+    SCAN(int16_t, int64_t, constant) break;
+  case TYPE_INT32:
+    SCAN(int32_t, int64_t, constant) break;
+  case TYPE_UINT8:
+  case TYPE_BOOL:
+  case TYPE_CHAR:
+    SCAN(uint8_t, int64_t, constant) break;
+  case TYPE_UINT16:
+    SCAN(uint16_t, int64_t, constant) break;
+  case TYPE_UINT32:
+    SCAN(uint32_t, int64_t, constant) break;
+  case TYPE_UINT:
+    SCAN(uint64_t, uint64_t, (uint64_t)constant) break;
+  default:
+    SCAN(int64_t, int64_t, constant) break;
+  }
+
+  return n;
+}
+
+static int64_t scanReals(Type *type, const char *data, int64_t stride,
+                         int64_t len, enum ScanOp op, double constant,
+                         int64_t *out) {
+  int64_t n = 0;
+
+  switch (type->kind) {
+  case TYPE_REAL32:
+    SCAN(float, double, constant) break;
+  case TYPE_REAL:
+    SCAN(double, double, constant) break;
+  case TYPE_UINT:
+    SCAN(uint64_t, double, constant) break;
+  default:
+    // Integer fields compared against a fractional constant
+    for (int64_t i = 0; i < len; i++) {
+      out[n] = i;
+      n += scanMatches(readOrdinal(type, (char *)data + i * stride), op,
+                       constant);
+    }
+    break;
+  }
+
+  return n;
+}
+
+#undef SCAN
+#undef SCAN_LOOP
+
+// For a constant that lies below or above every value a field can hold, such
+// as a negative constant against a uint field, which the casts in the loops
+// would get wrong. Every record compares the same way then.
+static int64_t scanOutOfRange(int64_t len, enum ScanOp op, bool below,
+                              int64_t *out) {
+  bool matches = op == SCAN_NE || (op != SCAN_EQ &&
+                                   (op == SCAN_GT || op == SCAN_GE) == below);
+  if (!matches)
+    return 0;
+
+  for (int64_t i = 0; i < len; i++)
+    out[i] = i;
+  return len;
+}
+
+static bool isScannable(Type *type) {
+  return isNumber(type) || type->kind == TYPE_BOOL;
+}
+
+typedef struct {
+  UmkaDynArray(int64_t) indices;
+  bool ok;
+} ScanResult;
+
+FN(reflScan, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+  const char *path = ARG(2)->ptrVal;
+  enum ScanOp op = ARG(3)->intVal;
+  Interface *constant = (Interface *)ARG(4);
+  Type *intarraytype = ARG(5)->ptrVal;
+
+  ScanResult *result = RET()->ptrVal;
+  DynArray *records;
+  Type *type = unwrapRecords(value, &records);
+  Type *constType = constant->selfType;
+  int64_t offset = 0;
+
+  Type *leaf = type ? resolveFieldPath(cache, type, path, &offset) : NULL;
+  result->ok = leaf && isScannable(leaf) && constType &&
+               isScannable(constType) && op >= SCAN_EQ && op <= SCAN_GE;
+  if (!result->ok) {
+    api->umkaMakeDynArray(umka, &result->indices, intarraytype, 0);
+    return;
+  }
+
+  int64_t len = dynArrayLen(records);
+  int64_t *out = malloc((len ? len : 1) * sizeof(int64_t));
+  const char *data = (const char *)records->data + offset;
+  int64_t n = 0;
+
+  if (isReal(leaf) || isReal(constType)) {
+    double k = 0;
+    if (constType->kind == TYPE_REAL32)
+      k = *(float *)constant->self;
+    else if (constType->kind == TYPE_REAL)
+      k = *(double *)constant->self;
+    else if (constType->kind == TYPE_UINT)
+      k = *(uint64_t *)constant->self;
+    else
+      k = readOrdinal(constType, constant->self);
+
+    n = scanReals(leaf, data, records->itemSize, len, op, k, out);
+  } else {
+    // A uint constant past INT64_MAX reads as negative here too
+    int64_t k = readOrdinal(constType, constant->self);
+    bool uintLeaf = leaf->kind == TYPE_UINT;
+    if (k < 0 && uintLeaf != (constType->kind == TYPE_UINT))
+      n = scanOutOfRange(len, op, uintLeaf, out);
+    else
+      n = scanIntegers(leaf, data, records->itemSize, len, op, k, out);
+  }
+
+  api->umkaMakeDynArray(umka, &result->indices, intarraytype, n);
+  if (n > 0)
+    memcpy(result->indices.data, out, n * sizeof(int64_t));
+  free(out);
+})
+
+// Parallel encoding --
+//
+// A long dynarray is encoded by several threads, each writing a range of the
+// items into its own buffer, and the buffers are joined in order, giving the
+// same bytes as encodeValue. Encoding only reads memory and never calls into
+// the instance, so reference counts are left alone. The one thing the
+// threads share is the cache, so every plan they can reach is compiled
+// beforehand, after which they only ever look plans up.
+//
+// Starting a thread costs more than encoding a few thousand items or a few
+// dozen kilobytes, so every thread must get at least that much of both, and
+// shorter dynarrays are encoded on the calling thread.
+
+enum {
+  MAX_ENCODE_THREADS = 64,
+  MIN_ITEMS_PER_THREAD = 1024,
+  MIN_BYTES_PER_THREAD = 64 * 1024
+};
+
+static void preparePlans(ReflCache *cache, PtrMap *visited, Type *type) {
+  if (ptrMapGet(visited, type))
+    return;
+  ptrMapPut(visited, type, type);
+
+  ValuePlan *plan = getPlan(cache, type);
+
+  for (int i = 0; i < plan->numOps; i++) {
+    PlanOp *op = &plan->ops[i];
+
+    switch (op->kind) {
+    case OP_PTR:
+    case OP_DYNARRAY:
+    case OP_ARRAY:
+      preparePlans(cache, visited, op->type->base);
+      break;
+    case OP_MAP:
+      preparePlans(cache, visited, mapKeyType(op->type));
+      preparePlans(cache, visited, mapItemType(op->type));
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+typedef struct {
+  ReflCache *cache;
+  Type *type;
+  char *data;
+  int64_t itemSize, begin, end;
+  ReflBuf buf;
+  bool ok;
+} EncodeChunk;
+
+static void encodeChunk(EncodeChunk *chunk) {
+  chunk->ok = true;
+
+  if (getPlan(chunk->cache, chunk->type)->isPod) {
+    bufWrite(&chunk->buf, chunk->data + chunk->begin * chunk->itemSize,
+             (chunk->end - chunk->begin) * chunk->itemSize);
+    return;
+  }
+
+  for (int64_t i = chunk->begin; i < chunk->end && chunk->ok; i++) {
+    chunk->ok = encodeValue(chunk->cache, &chunk->buf, chunk->type,
+                            chunk->data + i * chunk->itemSize);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI encodeThread(LPVOID arg) {
+  encodeChunk(arg);
+  return 0;
+}
+#else
+static void *encodeThread(void *arg) {
+  encodeChunk(arg);
+  return NULL;
+}
+#endif
+
+// Runs the chunks on threads of their own, except the first, which is
+// encoded by the calling thread. Chunks whose thread can't be started are
+// encoded by the calling thread too.
+static void runEncodeChunks(EncodeChunk *chunks, int numChunks) {
+#ifdef _WIN32
+  HANDLE threads[MAX_ENCODE_THREADS] = {0};
+  for (int i = 1; i < numChunks; i++)
+    threads[i] = CreateThread(NULL, 0, encodeThread, &chunks[i], 0, NULL);
+
+  encodeChunk(&chunks[0]);
+
+  for (int i = 1; i < numChunks; i++) {
+    if (threads[i]) {
+      WaitForSingleObject(threads[i], INFINITE);
+      CloseHandle(threads[i]);
+    } else {
+      encodeChunk(&chunks[i]);
+    }
+  }
+#else
+  pthread_t threads[MAX_ENCODE_THREADS];
+  bool started[MAX_ENCODE_THREADS] = {0};
+  for (int i = 1; i < numChunks; i++) {
+    started[i] =
+        pthread_create(&threads[i], NULL, encodeThread, &chunks[i]) == 0;
+  }
+
+  encodeChunk(&chunks[0]);
+
+  for (int i = 1; i < numChunks; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      encodeChunk(&chunks[i]);
+  }
+#endif
+}
+
+static bool encodeParallel(ReflCache *cache, ReflBuf *buf, Type *type,
+                           char *data, int numThreads) {
+  if (type->kind != TYPE_DYNARRAY)
+    return encodeValue(cache, buf, type, data);
+
+  DynArray *array = (DynArray *)data;
+  int64_t len = dynArrayLen(array);
+
+  if (numThreads > MAX_ENCODE_THREADS)
+    numThreads = MAX_ENCODE_THREADS;
+  if (numThreads > len / MIN_ITEMS_PER_THREAD)
+    numThreads = len / MIN_ITEMS_PER_THREAD;
+  if (numThreads > len * array->itemSize / MIN_BYTES_PER_THREAD)
+    numThreads = len * array->itemSize / MIN_BYTES_PER_THREAD;
+  if (numThreads < 2)
+    return encodeValue(cache, buf, type, data);
+
+  PtrMap visited = {0};
+  preparePlans(cache, &visited, type->base);
+  freePtrMap(&visited);
+
+  // Settle the growth getTypeInfo would otherwise do on the next lookup
+  if (cache->numTypes * 2 >= cache->numSlots)
+    growCache(cache);
+
+  EncodeChunk chunks[MAX_ENCODE_THREADS] = {0};
+  for (int i = 0; i < numThreads; i++) {
+    chunks[i].cache = cache;
+    chunks[i].type = type->base;
+    chunks[i].data = array->data;
+    chunks[i].itemSize = array->itemSize;
+    chunks[i].begin = len * i / numThreads;
+    chunks[i].end = len * (i + 1) / numThreads;
+  }
+
+  runEncodeChunks(chunks, numThreads);
+
+  bool ok = true;
+  bufWriteInt(buf, len);
+  for (int i = 0; i < numThreads; i++) {
+    ok = ok && chunks[i].ok;
+    if (ok)
+      bufWrite(buf, chunks[i].buf.data, chunks[i].buf.len);
+    free(chunks[i].buf.data);
+  }
+
+  return ok;
+}
+
+FN(reflEncodeParallel, {
+  ReflCache *cache = ARG(0)->ptrVal;
+  Interface *value = (Interface *)ARG(1);
+  int numThreads = ARG(2)->intVal;
+  Type *bytestype = ARG(3)->ptrVal;
+
+  EncodeResult *result = RET()->ptrVal;
+  ReflBuf buf = {0};
+  char *data = value->self;
+
+  if (value->selfType && value->selfType->kind == TYPE_PTR)
+    data = (char *)&value->self;
+
+  result->ok = value->selfType != NULL &&
+               encodeParallel(cache, &buf, value->selfType, data, numThreads);
+
+  api->umkaMakeDynArray(umka, &result->bytes, bytestype,
+                        result->ok ? buf.len : 0);
+  if (result->ok && buf.len > 0)
+    memcpy(result->bytes.data, buf.data, buf.len);
+
+  free(buf.data);
+})
+
+// Profiling results --
+
+typedef struct {
+  const char *name;
+  ProfileCounter counter;
+} ExportStat;
+
+typedef struct {
+  void *type;
+  ProfileCounter counter;
+} TypeStat;
+
+typedef struct {
+  bool enabled;
+  UmkaDynArray(ExportStat) exports;
+  UmkaDynArray(TypeStat) types;
+} StatsResult;
+
+#ifdef REFL_PROFILE
+static void addCounter(ProfileCounter *sum, const ProfileCounter *counter) {
+  sum->calls += counter->calls;
+  sum->ns += counter->ns;
+  sum->bytes += counter->bytes;
+}
+
+static int compareExportStats(const void *a, const void *b) {
+  int64_t x = ((const ExportStat *)a)->counter.ns;
+  int64_t y = ((const ExportStat *)b)->counter.ns;
+  return (x < y) - (x > y);
+}
+
+static int compareTypeStats(const void *a, const void *b) {
+  int64_t x = ((const TypeStat *)a)->counter.ns;
+  int64_t y = ((const TypeStat *)b)->counter.ns;
+  return (x < y) - (x > y);
+}
+
+// Sums the rows of every thread. Exports are shared by all instances, while
+// types are only reported to the instance they belong to.
+static void collectStats(void *umka, UmkaAPI *api, StatsResult *result,
+                         Type *exportstattype, Type *typestattype) {
+  ProfileCounter exports[MAX_PROFILED_EXPORTS] = {0};
+  PtrMap typeIndex = {0};
+  TypeStat *types = NULL;
+  int64_t numTypes = 0;
+  int64_t capacity = 0;
+
+  profileLock();
+
+  for (ProfileThread *thread = profileThreads; thread; thread = thread->next) {
+    for (int i = 0; i < numProfileNames; i++)
+      addCounter(&exports[i], &thread->exports[i]);
+
+    for (int64_t i = 0; i < thread->numTypeSlots; i++) {
+      ProfileTypeRow *row = &thread->types[i];
+      if (!row->used || row->umka != umka || row->counter.calls == 0)
+        continue;
+
+      intptr_t index = (intptr_t)ptrMapGet(&typeIndex, row->type);
+      if (index == 0) {
+        if (numTypes == capacity) {
+          capacity = capacity ? capacity * 2 : 64;
+          types = realloc(types, capacity * sizeof(TypeStat));
+        }
+        types[numTypes] = (TypeStat){row->type, {0}};
+        index = ++numTypes;
+        ptrMapPut(&typeIndex, row->type, (void *)index);
+      }
+      addCounter(&types[index - 1].counter, &row->counter);
+    }
+  }
+
+  int numNames = numProfileNames;
+  profileUnlock();
+
+  int numExports = 0;
+  for (int i = 0; i < numNames; i++)
+    numExports += exports[i].calls > 0;
+
+  api->umkaMakeDynArray(umka, &result->exports, exportstattype, numExports);
+  for (int i = 0, j = 0; i < numNames; i++) {
+    if (exports[i].calls == 0)
+      continue;
+    result->exports.data[j].name = api->umkaMakeStr(umka, profileNames[i]);
+    result->exports.data[j].counter = exports[i];
+    j++;
+  }
+
+  api->umkaMakeDynArray(umka, &result->types, typestattype, numTypes);
+  if (numTypes > 0)
+    memcpy(result->types.data, types, numTypes * sizeof(TypeStat));
+
+  if (numExports > 1)
+    qsort(result->exports.data, numExports, sizeof(ExportStat),
+          compareExportStats);
+  if (numTypes > 1)
+    qsort(result->types.data, numTypes, sizeof(TypeStat), compareTypeStats);
+
+  free(types);
+  freePtrMap(&typeIndex);
+}
+#endif
+
+// Neither export counts itself. Without REFL_PROFILE, no calls are recorded
+// and the stats are empty.
+RAW_FN(reflStats, {
+  Type *exportstattype = ARG(0)->ptrVal;
+  Type *typestattype = ARG(1)->ptrVal;
+
+  StatsResult *result = RET()->ptrVal;
+
+#ifdef REFL_PROFILE
+  result->enabled = true;
+  collectStats(umka, api, result, exportstattype, typestattype);
+#else
+  result->enabled = false;
+  api->umkaMakeDynArray(umka, &result->exports, exportstattype, 0);
+  api->umkaMakeDynArray(umka, &result->types, typestattype, 0);
+#endif
+})
+
+RAW_FN(reflResetStats, {
+#ifdef REFL_PROFILE
+  profileLock();
+
+  for (ProfileThread *thread = profileThreads; thread; thread = thread->next) {
+    memset(thread->exports, 0, sizeof(thread->exports));
+    for (int64_t i = 0; i < thread->numTypeSlots; i++)
+      memset(&thread->types[i].counter, 0, sizeof(ProfileCounter));
+  }
+
+  profileUnlock();
+#endif
+})
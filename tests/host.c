@@ -0,0 +1,61 @@
+// Calls a method of a script type from the host through reflGetMethodContext,
+// with the receiver in the first parameter slot, and checks that the method
+// ran on it. Links against refl.umi, so that the host and the script share one
+// copy of the library. Linux only.
+// Run from the repository root, after building refl.umi, with UMKA_DIR
+// pointing to a directory with libumka.so:
+//     gcc tests/host.c ./refl.umi -o tests/host -L"$UMKA_DIR"
+//         -Wl,-rpath,"$UMKA_DIR" -Wl,-rpath,. -lumka
+//     ./tests/host
+
+#include "../umka_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+bool reflGetMethodContext(void *cacheHandle, void *type, const char *name,
+                          UmkaFuncContext *fn);
+
+static void check(bool cond, const char *msg) {
+  if (!cond) {
+    printf("FAIL: %s\n", msg);
+    exit(1);
+  }
+}
+
+// Calls an exported function of the script that takes no parameters
+static void *callScript(void *umka, const char *name) {
+  UmkaFuncContext fn = {0};
+  check(umkaGetFunc(umka, NULL, name, &fn), name);
+  check(umkaCall(umka, &fn) == 0, name);
+  return umkaGetResult(fn.params, fn.result)->ptrVal;
+}
+
+int main(void) {
+  void *umka = umkaAlloc();
+  check(umkaInit(umka, "tests/modules/counter.um", NULL, 1024 * 1024, NULL, 0,
+                 NULL, true, true, NULL),
+        "init");
+  check(umkaCompile(umka), "compile");
+  check(umkaRun(umka) == 0, "run");
+
+  void *cache = callScript(umka, "cacheHandle");
+  void *counterType = callScript(umka, "counterType");
+  void *counter = callScript(umka, "theCounter");
+
+  UmkaFuncContext add = {0}, sub = {0};
+  check(reflGetMethodContext(cache, counterType, "add", &add), "add");
+  check(!reflGetMethodContext(cache, counterType, "sub", &sub), "no sub");
+
+  for (int i = 0; i < 3; i++) {
+    umkaGetParam(add.params, 0)->ptrVal = counter;
+    umkaGetParam(add.params, 1)->intVal = 10;
+    check(umkaCall(umka, &add) == 0, "call");
+  }
+
+  check(umkaGetResult(add.params, add.result)->intVal == 31, "result");
+  check(*(int64_t *)counter == 31, "receiver changed");
+
+  umkaFree(umka);
+  printf("host: ok\n");
+  return 0;
+}